@@ -1,259 +1,8286 @@
 #include <iostream>
 #include <vector>
+#include <array>
 #include <algorithm>
 #include <map>
+#include <list>
+#include <set>
+#include <unordered_map>
 #include <cmath>
 #include <sstream>
+#include <fstream>
 #include <string>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <new>
+#include <deque>
+#include <queue>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static const int M = 8;
 static const int MAX_ID = 1 << M;
+static const int KADEMLIA_K = 3;
+static const int SYMPHONY_ESTIMATE_SEGMENTS = 3;
+
+static int SYMPHONY_LINKS = 4;
+
+enum PlacementMode {
+    PLACEMENT_SUCCESSOR,
+    PLACEMENT_BOUNDED_LOAD,
+    PLACEMENT_TWO_CHOICES
+};
+
+static PlacementMode PLACEMENT = PLACEMENT_SUCCESSOR;
+static double BOUNDED_LOAD_EPSILON = 0.25;
+static const size_t RECLAIM_BATCH = 64;
+static const int KEY_STORE_STRIPES = 16;
+static const size_t KEY_STORE_MIN_CAPACITY = 16;
+static const size_t KEY_STORE_MIGRATE_CHUNK = 64;
+static const int SMALL_STORE_CAPACITY = 8;
+// Room reserved in every Node for an inline SmallKeyStore: vtable and
+// spill pointers plus the count and the two arrays, padded.
+static const size_t SMALL_STORE_BYTES = 2 * sizeof(void*) + (2 * SMALL_STORE_CAPACITY + 2) * sizeof(int);
+static const int EF_SELECT_SAMPLE = 64;
+static const double MPH_LOAD_FACTOR = 0.97;
+static const size_t MPH_BUCKET_SIZE = 5;
+static const uint64_t MPH_MAX_PILOT = 1 << 20;
+static const size_t MPH_DELTA_LIMIT = 64;
+
+enum KeyStoreKind {
+    STORE_MAP,
+    STORE_CONCURRENT,
+    STORE_SMALL,
+    STORE_ELIAS_FANO,
+    STORE_PERFECT_HASH,
+    STORE_CACHE,
+    STORE_TIERED
+};
+
+static KeyStoreKind KEY_STORE_KIND = STORE_MAP;
+// Entry budget per node when the ring runs as a cache (STORE_CACHE).
+static size_t CACHE_CAPACITY = 64;
+static const int CACHE_WINDOW_PERCENT = 1;
+static const int CACHE_PROTECTED_PERCENT = 80;
+// Tiered stores (STORE_TIERED) keep this many keys in memory per node and
+// demote the least recently used ones to sorted run files in TIER_DIRECTORY.
+static size_t TIER_HOT_CAPACITY = 1024;
+static const size_t TIER_MAX_RUNS = 8;
+static const size_t TIER_RUN_KEYS = 4096;
+static std::string TIER_DIRECTORY = "/tmp";
+// Writes are queued at the owner and applied in key-sorted batches by
+// whichever queued writer takes the drain lock.
+static bool COALESCE_WRITES = false;
+// Admission control for coalesced writes: an owner with this many writes
+// queued rejects new ones and the router backs off before retrying
+// (0 = unbounded inbox).
+static int INBOX_CAPACITY = 0;
+// A write rejected this many times is shed: insert_key and remove_key give
+// up and return false (0 = back off and retry until admitted).
+static int WRITE_MAX_REJECTIONS = 0;
+static const int BACKPRESSURE_BASE_US = 20;
+static const int BACKPRESSURE_MAX_SHIFT = 6;
+
+// Hot-path counters are striped over cache lines so threads bumping them
+// do not share a line; readers sum the stripes.
+static const int METRIC_STRIPES = 16;
+
+struct alignas(64) CounterStripe {
+    std::atomic<uint64_t> value;
+};
+
+class StripedCounter {
+public:
+    StripedCounter();
+
+    void add(uint64_t n = 1);
+    uint64_t load() const;
+
+private:
+    CounterStripe stripes[METRIC_STRIPES];
+};
+
+// Memory accounting by subsystem. Containers take a TrackingAllocator and
+// heap objects derive from TrackedObject; both report to MEMORY[tag], where live
+// bytes are allocated minus freed.
+enum MemoryTag {
+    MEM_NODES,
+    MEM_ROUTING,
+    MEM_KEYS,
+    MEM_MIGRATION,
+    MEM_PATHS,
+    MEM_INSTRUMENTATION,
+    MEM_TAG_COUNT
+};
+
+struct MemoryAccount {
+    StripedCounter allocated_bytes;
+    StripedCounter freed_bytes;
+    StripedCounter allocations;
+};
+
+static MemoryAccount MEMORY[MEM_TAG_COUNT];
+static const char* MEMORY_TAG_NAMES[MEM_TAG_COUNT] = {
+    "nodes", "routing", "keys", "migration", "paths", "instrumentation"
+};
+
+struct MemoryUsage {
+    uint64_t live_bytes;
+    uint64_t allocated_bytes;
+    uint64_t allocations;
+};
+
+void memory_allocated(MemoryTag tag, size_t bytes);
+void memory_freed(MemoryTag tag, size_t bytes);
+MemoryUsage memory_usage(MemoryTag tag);
+
+template <class T, MemoryTag Tag>
+struct TrackingAllocator {
+    typedef T value_type;
+
+    TrackingAllocator() {}
+    template <class U>
+    TrackingAllocator(const TrackingAllocator<U, Tag>&) {}
+    template <class U>
+    struct rebind {
+        typedef TrackingAllocator<U, Tag> other;
+    };
+
+    T* allocate(size_t n) {
+        memory_allocated(Tag, n * sizeof(T));
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* p, size_t n) {
+        memory_freed(Tag, n * sizeof(T));
+        std::allocator<T>().deallocate(p, n);
+    }
+};
+
+template <class T, class U, MemoryTag Tag>
+bool operator==(const TrackingAllocator<T, Tag>&, const TrackingAllocator<U, Tag>&) {
+    return true;
+}
+
+template <class T, class U, MemoryTag Tag>
+bool operator!=(const TrackingAllocator<T, Tag>&, const TrackingAllocator<U, Tag>&) {
+    return false;
+}
+
+// Counts sizeof(T) for as long as the object lives.
+template <class T, MemoryTag Tag>
+struct TrackedObject {
+    TrackedObject() { memory_allocated(Tag, sizeof(T)); }
+    TrackedObject(const TrackedObject&) { memory_allocated(Tag, sizeof(T)); }
+    ~TrackedObject() { memory_freed(Tag, sizeof(T)); }
+};
+
+// Routing paths returned by find_key, and key lists returned by
+// KeyStore::items()/extract_range(), which are mostly handoff buffers.
+typedef std::vector<int, TrackingAllocator<int, MEM_PATHS>> Path;
+typedef std::vector<std::pair<int,int>, TrackingAllocator<std::pair<int,int>, MEM_MIGRATION>> KeyList;
 
 class FingerTable;
+class KBucketTable;
+class SymphonyTable;
+class KeyStore;
+class WriteAheadLog;
+class BlobRef;
+class BlobWriter;
+
+enum WriteState {
+    WRITE_PENDING,
+    WRITE_APPLIED,
+    WRITE_FENCED,
+    WRITE_REJECTED
+};
+
+struct PendingWrite {
+    PendingWrite(int k, int v, bool e, uint64_t seen)
+        : key(k), value(v), erase(e), seen_epoch(seen), state(WRITE_PENDING) {}
+
+    int key;
+    int value;
+    bool erase;
+    uint64_t seen_epoch;
+    std::atomic<int> state;
+};
+
+// How an operation travels with its lookup (see Node::route_operation).
+// LOOKUP_THEN_OP is the find_key-then-access pattern: an iterative lookup
+// and then a separate round trip to the owner. ITERATIVE piggybacks the
+// operation on the query that reaches the owner; RECURSIVE forwards it hop
+// by hop and returns the reply along the same path; SEMI_RECURSIVE forwards
+// it the same way but the owner replies to the client directly.
+enum RoutingMode {
+    ROUTE_LOOKUP_THEN_OP,
+    ROUTE_ITERATIVE,
+    ROUTE_RECURSIVE,
+    ROUTE_SEMI_RECURSIVE
+};
+
+enum RoutedOpKind {
+    ROUTED_GET,
+    ROUTED_PUT,
+    ROUTED_REMOVE
+};
+
+class Node;
+
+struct RoutedReply {
+    bool found;
+    int value;
+    Node* owner;
+    int hops;
+    int messages;
+    double latency_ms;
+};
+
+static RoutingMode ROUTING_MODE = ROUTE_LOOKUP_THEN_OP;
+
+class Node : public TrackedObject<Node, MEM_NODES> {
+public:
+    explicit Node(int node_id);
+    ~Node();
+
+    void update_finger_table();
+    Node* get_successor();
+    Node* closest_preceding_finger(int key);
+
+    std::pair<Node*, Path> find_key(int key);
+    bool insert_key(int key, int value = -1);
+    bool remove_key(int key);
+    bool exchange_key(int key, int value, bool erase, int& previous);
+    bool insert_blob(int key, const char* data, size_t size);
+    bool insert_blob(int key, BlobWriter& value);
+    bool insert_blob_handle(int key, int handle);
+    bool get_blob(int key, BlobRef& blob);
+    bool remove_blob(int key);
+    void store_key(int key, int value);
+    bool fenced_store(int key, int value, uint64_t seen_epoch);
+    bool fenced_erase(int key, uint64_t seen_epoch);
+    bool fenced_get(int key, uint64_t seen_epoch, int& value, bool& found);
+    WriteState fenced_exchange(int key, int value, bool erase, uint64_t seen_epoch, int& previous);
+    RoutedReply route_operation(RoutedOpKind kind, int key, int value = 0);
+    void erase_key(int key);
+    void count_keys();
+    void freeze_keys();
+    WriteState submit_write(int key, int value, bool erase, uint64_t seen_epoch);
+    void drain_inbox();
+    Node* locate_key(int key, int* extra_probes = nullptr);
+
+    void join(Node* contact);
+    void leave();
+
+    void print_finger_table();
+
+    int id;
+    std::atomic<bool> alive;
+    // Ownership of the key range (range_start, id]. Every handoff bumps the
+    // epoch under an exclusive range_mutex; writes hold it shared and are
+    // rejected if the epoch they were routed with is stale.
+    std::atomic<uint64_t> epoch;
+    std::atomic<int> range_start;
+    std::shared_mutex range_mutex;
+    FingerTable* finger;
+    KBucketTable* kbuckets;
+    SymphonyTable* symphony;
+    KeyStore* keys;
+    // keys->size() as of the last change, for readers that take no lock
+    // (the metrics exporter); whoever changes the store calls count_keys().
+    std::atomic<size_t> key_count;
+    // With STORE_SMALL the key store is built in place here, so a lightly
+    // loaded node is a single allocation.
+    alignas(void*) unsigned char inline_keys[SMALL_STORE_BYTES];
+    // Bounded-load placement: keys this node is primary for that were
+    // stored `n` successors further along because this node was full.
+    std::map<int,unsigned char> overflow;
+    // Two-choices placement: keys this node is primary for that live on the
+    // less loaded owner of their second hash.
+    std::map<int,Node*> redirects;
+    // Coalesced writes waiting for the next batch (see COALESCE_WRITES).
+    std::mutex inbox_mutex;
+    std::vector<PendingWrite*> inbox;
+    std::atomic<int> queue_depth;
+    std::mutex drain_mutex;
+};
+
+static std::vector<Node*> DHT_NODES;
+// Guards DHT_NODES and routing-table repair. Key handoffs run outside it,
+// so membership changes in different parts of the ring overlap.
+static std::mutex MEMBERSHIP_MUTEX;
+static std::atomic<long> FENCED_WRITES(0);
+static std::atomic<long> BACKPRESSURE_SIGNALS(0);
+static std::atomic<long> SHED_WRITES(0);
+static bool LOG_MIGRATIONS = true;
+
+struct WalRecord {
+    int32_t node;
+    int32_t key;
+    int32_t value;
+    int32_t erase;
+};
+
+// Append-only log of applied writes. Each append is one write() and, with
+// sync enabled, one fdatasync(), so a coalesced batch is one group commit.
+// append() is false if the records may not be durable; callers must not
+// apply or acknowledge them.
+class WriteAheadLog {
+public:
+    WriteAheadLog(const std::string& path, bool sync_writes);
+    ~WriteAheadLog();
+
+    bool append(const std::vector<WalRecord>& records);
+
+    std::atomic<size_t> appends;
+    std::atomic<size_t> records_written;
+    std::atomic<size_t> failures;
+
+private:
+    int fd;
+    bool sync;
+    std::mutex mutex;
+};
+
+static WriteAheadLog* WAL = nullptr;
+
+// Large values live out of line in BLOBS and key stores hold only their
+// int handle, so migration hands over handles instead of bytes. Blobs are
+// reference counted: the key store's copy is one reference and readers
+// pin the blob with a BlobRef while they stream it in BLOB_CHUNK_SIZE
+// views. A key holds either plain values or blob handles, never both, and
+// blob keys expect one writer at a time. Values too large to build in
+// memory are streamed in with BlobWriter and kept in mapped files.
+//
+// A handle packs a slot index with the slot's generation, which moves on
+// whenever the slot is freed, so a reader holding a handle from before an
+// overwrite never pins the blob that reuses the slot. Blobs stored under a
+// key are bound to it; the key-checked retain and release ignore plain
+// values and blobs of other keys.
+static const size_t BLOB_CHUNK_SIZE = 64 * 1024;
+static const int BLOB_SLOT_BITS = 20;
+static const int BLOB_ANY_KEY = -1;
+
+class BlobArena {
+public:
+    ~BlobArena();
+
+    int put(const char* data, size_t size);
+    void bind(int handle, int key);
+    bool retain(int handle, int key = BLOB_ANY_KEY);
+    void release(int handle, int key = BLOB_ANY_KEY);
+    size_t size(int handle);
+    std::pair<const char*, size_t> chunk(int handle, size_t index);
+    bool send(int handle, int socket);
+    int adopt_file(int fd, size_t size);
+    size_t live_blobs();
+
+private:
+    // Either owns its bytes or maps a file that BlobWriter streamed out.
+    struct Blob {
+        Blob() : refs(1), key(BLOB_ANY_KEY), fd(-1), mapped(nullptr), mapped_size(0) {}
+        ~Blob();
+        const char* data() const { return fd >= 0 ? mapped : bytes.data(); }
+        size_t length() const { return fd >= 0 ? mapped_size : bytes.size(); }
+
+        std::atomic<int> refs;
+        int key;
+        std::vector<char, TrackingAllocator<char, MEM_KEYS>> bytes;
+        int fd;
+        char* mapped;
+        size_t mapped_size;
+    };
+
+    int insert(Blob* blob);
+    Blob* slot(int handle);
+    Blob* locate(int handle, int key);
+
+    std::mutex mutex;
+    std::vector<Blob*> slots;
+    std::vector<uint32_t> generations;
+    std::vector<int> free_slots;
+};
+
+static BlobArena BLOBS;
+
+class BlobRef {
+public:
+    BlobRef() : handle(-1) {}
+    ~BlobRef() { reset(); }
+    BlobRef(const BlobRef&) = delete;
+    BlobRef& operator=(const BlobRef&) = delete;
+
+    bool acquire(int blob_handle, int key = BLOB_ANY_KEY);
+    void reset();
+    bool valid() const { return handle >= 0; }
+    size_t size() const { return BLOBS.size(handle); }
+    size_t chunk_count() const { return (size() + BLOB_CHUNK_SIZE - 1) / BLOB_CHUNK_SIZE; }
+    std::pair<const char*, size_t> chunk(size_t index) const { return BLOBS.chunk(handle, index); }
+    bool send(int socket) const { return BLOBS.send(handle, socket); }
+
+private:
+    int handle;
+};
+
+// Preallocated BLOB_CHUNK_SIZE buffers that streaming requests borrow
+// instead of allocating their own. acquire() waits while every buffer is
+// out, so streaming never holds more than STREAM_BUFFER_COUNT chunks
+// however large the values are. The buffers are allocated on first use.
+static const size_t STREAM_BUFFER_COUNT = 8;
+
+class ChunkPool {
+public:
+    explicit ChunkPool(size_t count) : buffer_count(count), in_use(0), peak(0) {}
+
+    char* acquire();
+    void release(char* buffer);
+    size_t peak_in_use();
+    void reset_peak();
+
+private:
+    size_t buffer_count;
+    std::vector<char, TrackingAllocator<char, MEM_KEYS>> storage;
+    std::vector<char*> free_buffers;
+    size_t in_use;
+    size_t peak;
+    std::mutex mutex;
+    std::condition_variable available;
+};
+
+static ChunkPool STREAM_BUFFERS(STREAM_BUFFER_COUNT);
+
+// Chunked put for large values: appended bytes go straight to an unlinked
+// file in TIER_DIRECTORY, and finish() maps it read-only and registers it
+// as a blob, so the value is never assembled in memory. The returned
+// handle carries one reference; an unfinished writer discards its file.
+class BlobWriter {
+public:
+    BlobWriter();
+    ~BlobWriter();
+    BlobWriter(const BlobWriter&) = delete;
+    BlobWriter& operator=(const BlobWriter&) = delete;
+
+    bool append(const char* data, size_t size);
+    size_t append_from(int source, size_t size);
+    int finish();
+    size_t size() const { return written; }
+
+private:
+    int fd;
+    size_t written;
+    bool failed;
+};
+
+// Live tail latency per operation over the last LATENCY_SLOTS *
+// LATENCY_SLOT_MS milliseconds. Each slot is a log-linear histogram (four
+// sub-buckets per power of two of nanoseconds) that recorders bump with
+// relaxed atomic adds; the first recorder of a new slot period claims the
+// slot by CAS on its tick and clears it, so a record racing that clear may
+// be dropped. Queries sum the slots that are still inside the window.
+enum LatencyOp {
+    OP_FIND,
+    OP_INSERT,
+    OP_JOIN,
+    OP_LEAVE,
+    OP_COUNT
+};
+
+static bool MONITOR_LATENCY = false;
+static const int LATENCY_BUCKETS = 160;
+static const int LATENCY_SLOTS = 10;
+static const long LATENCY_SLOT_MS = 100;
+
+struct LatencySnapshot {
+    uint64_t count;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+};
+
+struct LatencySlot {
+    std::atomic<long> tick;
+    std::atomic<uint64_t> counts[LATENCY_BUCKETS];
+};
+
+class LatencyMonitor {
+public:
+    LatencyMonitor();
+
+    void record(LatencyOp op, uint64_t ns, long tick);
+    LatencySnapshot query(LatencyOp op);
+    // When a slot rotates and the window's p99 for `op` is above the
+    // threshold, the window is dumped to std::cerr (0 disables).
+    void set_trigger(LatencyOp op, uint64_t p99_threshold_ns);
+    void reset();
+
+    std::atomic<long> trigger_fires;
+
+private:
+    void dump(LatencyOp op, const LatencySnapshot& snapshot);
+
+    LatencySlot slots[OP_COUNT][LATENCY_SLOTS];
+    std::atomic<uint64_t> thresholds[OP_COUNT];
+};
+
+static LatencyMonitor LATENCY;
+
+struct RingMetrics {
+    RingMetrics();
+
+    StripedCounter lookups;
+    StripedCounter lookup_hops;
+    StripedCounter writes;
+    StripedCounter migrated_keys;
+    StripedCounter migration_bytes;
+    StripedCounter finger_rebuilds;
+};
+
+static RingMetrics METRICS;
+
+void record_migration(size_t key_count);
+
+// Serves render_metrics() in Prometheus text format on 127.0.0.1 from a
+// background thread. Port 0 picks a free port.
+class MetricsExporter {
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    bool start(int port);
+    void stop();
+    int port() const { return bound_port; }
+
+private:
+    void serve();
+
+    int listen_fd;
+    int bound_port;
+    std::atomic<bool> running;
+    std::thread server;
+};
+
+// Loopback HTTP access to blob keys through a contact node. GET
+// /blob/<key> sends the value with BlobArena::send and PUT /blob/<key>
+// streams a Content-Length body into a BlobWriter through one pooled
+// buffer. Requests are served one at a time on a background thread.
+class BlobServer {
+public:
+    explicit BlobServer(Node* contact_node);
+    ~BlobServer();
+
+    bool start(int port);
+    void stop();
+    int port() const { return bound_port; }
+
+private:
+    void serve();
+    void handle(int client);
+
+    Node* contact;
+    int listen_fd;
+    int bound_port;
+    std::atomic<bool> running;
+    std::thread server;
+};
+
+class LatencyTimer {
+public:
+    explicit LatencyTimer(LatencyOp timed_op);
+    ~LatencyTimer();
+
+private:
+    LatencyOp op;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+
+// constexpr so the compile-time StaticRing routes with the same test.
+constexpr bool in_interval(int x, int a, int b, bool inclusive=false) {
+    if (a < b) {
+        return inclusive ? (a < x && x <= b) : (a < x && x < b);
+    } else if (a > b) {
+        return inclusive ? (x > a || x <= b) : (x > a || x < b);
+    } else {
+        return true;
+    }
+}
+
+void update_all_finger_tables();
+void update_all_kbuckets();
+void update_all_symphony_tables();
+void rebalance_placement();
+int second_choice_hash(int key);
+uint64_t mix64(uint64_t h);
+size_t count_stored_keys();
+Node* get_successor_for(int key);
+Node* get_xor_closest(int key);
+void publish_members();
+Node* get_next_node(Node* node);
+Node* get_predecessor(Node* node);
+
+
+// Epoch-based reclamation for departed nodes and replaced finger rows that
+// concurrent lookups may still be reading. Readers pin the global epoch with
+// an EpochGuard (no locks after a thread's first guard); writers retire
+// unlinked objects, which are freed in batches of RECLAIM_BATCH once every
+// pinned reader has moved at least two epochs past the retirement.
+struct EpochRecord {
+    std::atomic<unsigned long> epoch;
+    std::atomic<bool> active;
+    std::atomic<bool> in_use;
+    int depth;
+};
+
+struct RetiredObject {
+    void* object;
+    void (*deleter)(void*);
+    unsigned long epoch;
+};
+
+class EpochReclaimer {
+public:
+    EpochReclaimer() : global_epoch(0), retired_total(0), reclaimed_total(0) {}
+    ~EpochReclaimer() { drain(); }
+
+    void enter();
+    void exit();
+    template <class T>
+    void retire(T* object) {
+        retire_object(const_cast<void*>(static_cast<const void*>(object)),
+                      [](void* p){ delete static_cast<T*>(p); });
+    }
+    void retire_object(void* object, void (*deleter)(void*));
+    void drain();
+    size_t pending();
+
+    std::atomic<unsigned long> global_epoch;
+    std::atomic<size_t> retired_total;
+    std::atomic<size_t> reclaimed_total;
+
+private:
+    EpochRecord* local_record();
+    void reclaim_locked();
+
+    std::mutex mutex;
+    std::vector<EpochRecord*> records;
+    std::vector<RetiredObject> limbo;
+};
+
+static EpochReclaimer RECLAIMER;
+
+class EpochGuard {
+public:
+    EpochGuard() { RECLAIMER.enter(); }
+    ~EpochGuard() { RECLAIMER.exit(); }
+};
+
+// Per-node key/value storage. items() and extract_range() return pairs
+// sorted by key; extract_range removes and returns every key k with
+// in_interval(k, a, b, true), which is what join migration hands over.
+class KeyStore {
+public:
+    virtual ~KeyStore() {}
+
+    virtual bool get(int key, int& value) const = 0;
+    virtual void put(int key, int value) = 0;
+    virtual bool erase(int key) = 0;
+    virtual size_t size() const = 0;
+    virtual KeyList items() const = 0;
+    virtual KeyList extract_range(int a, int b);
+    // Moves the keys extract_range(a, b) would return into `target`, listing
+    // them in `moved` if given, and returns how many moved.
+    virtual size_t move_range(KeyStore* target, int a, int b, std::vector<int>* moved = nullptr);
+    virtual void clear();
+    // Compacts the store for read-mostly use; a no-op for mutable stores.
+    virtual void freeze() {}
+
+    bool contains(int key) const {
+        int value;
+        return get(key, value);
+    }
+};
+
+class MapKeyStore : public KeyStore, public TrackedObject<MapKeyStore, MEM_KEYS> {
+public:
+    bool get(int key, int& value) const override;
+    void put(int key, int value) override;
+    bool erase(int key) override;
+    size_t size() const override { return data.size(); }
+    KeyList items() const override;
+    KeyList extract_range(int a, int b) override;
+    void clear() override { data.clear(); }
+
+private:
+    std::map<int,int,std::less<int>,TrackingAllocator<std::pair<const int,int>, MEM_KEYS>> data;
+};
+
+// Store for lightly loaded nodes: up to SMALL_STORE_CAPACITY entries are
+// kept sorted in inline arrays, so a node with a handful of keys costs one
+// small object and a lookup is a short linear scan. Past that the entries
+// spill into a MapKeyStore; once it shrinks to half the capacity they move
+// back inline.
+class SmallKeyStore : public KeyStore, public TrackedObject<SmallKeyStore, MEM_KEYS> {
+public:
+    SmallKeyStore() : count(0), spilled(nullptr) {}
+    ~SmallKeyStore() override { delete spilled; }
+
+    bool get(int key, int& value) const override;
+    void put(int key, int value) override;
+    bool erase(int key) override;
+    size_t size() const override { return spilled ? spilled->size() : count; }
+    KeyList items() const override;
+    KeyList extract_range(int a, int b) override;
+    void clear() override;
+
+private:
+    void spill();
+    void maybe_unspill();
+
+    int count;
+    int keys[SMALL_STORE_CAPACITY];
+    int values[SMALL_STORE_CAPACITY];
+    MapKeyStore* spilled;
+};
+
+static_assert(sizeof(SmallKeyStore) <= SMALL_STORE_BYTES && alignof(SmallKeyStore) <= alignof(void*),
+              "Node::inline_keys cannot hold a SmallKeyStore");
+
+// Read-mostly store. freeze() encodes the sorted keys with Elias-Fano:
+// the low `low_bits` of each key go into a packed array and the high part
+// as unary gaps in `uppers`, about 2 + log2(universe / n) bits per key.
+// Values sit in a parallel array of fixed-width offsets from the smallest
+// value. Keys must be non-negative. A lookup jumps to its high bucket with a
+// sampled select0 and scans that bucket; extract_range re-encodes in place.
+// Any write that changes the contents thaws the store into a MapKeyStore
+// until the next freeze().
+class EliasFanoKeyStore : public KeyStore, public TrackedObject<EliasFanoKeyStore, MEM_KEYS> {
+public:
+    EliasFanoKeyStore() : count(0), low_bits(0), value_base(0), value_bits(0), thawed(nullptr) {}
+    ~EliasFanoKeyStore() override { delete thawed; }
+
+    bool get(int key, int& value) const override;
+    void put(int key, int value) override;
+    bool erase(int key) override;
+    size_t size() const override { return thawed ? thawed->size() : count; }
+    KeyList items() const override;
+    KeyList extract_range(int a, int b) override;
+    void clear() override;
+    void freeze() override;
+
+    bool frozen() const { return thawed == nullptr; }
+    size_t key_bits() const;
+    size_t encoded_bytes() const;
+
+private:
+    typedef std::vector<uint64_t, TrackingAllocator<uint64_t, MEM_KEYS>> Bits;
+
+    void encode(const KeyList& entries);
+    void thaw();
+    size_t select_zero(size_t rank) const;
+    size_t lower_bound(int key, bool& found) const;
+    bool upper_bit(size_t pos) const { return (uppers[pos / 64] >> (pos % 64)) & 1; }
+
+    size_t count;
+    int low_bits;
+    int value_base;
+    int value_bits;
+    Bits lows;
+    Bits uppers;
+    Bits values;
+    std::vector<uint32_t, TrackingAllocator<uint32_t, MEM_KEYS>> zero_samples;
+    MapKeyStore* thawed;
+};
+
+// Point-read store for nodes that are bulk loaded and then mostly read.
+// freeze() builds a PTHash-style minimal perfect hash: keys hash into
+// buckets of about MPH_BUCKET_SIZE and each bucket, largest first, gets the
+// smallest pilot that sends all of its keys to free slots of a table of
+// n / MPH_LOAD_FACTOR; slots past n are remapped into the holes below n.
+// A lookup reads one pilot and probes one slot, whose stored key is the
+// fingerprint that rejects non-members.
+// Writes after a freeze go to a delta layer of upserts and tombstones. When
+// it outgrows MPH_DELTA_LIMIT (or 1/16 of the index) it is sealed and a
+// background thread merges it into a new index, which the next write
+// installs. Callers must not overlap, as with MapKeyStore.
+class PerfectHashKeyStore : public KeyStore, public TrackedObject<PerfectHashKeyStore, MEM_KEYS> {
+public:
+    PerfectHashKeyStore();
+    ~PerfectHashKeyStore() override;
+
+    bool get(int key, int& value) const override;
+    void put(int key, int value) override;
+    bool erase(int key) override;
+    size_t size() const override { return live; }
+    KeyList items() const override;
+    KeyList extract_range(int a, int b) override;
+    void clear() override;
+    void freeze() override;
+
+    void wait_for_rebuild();
+    size_t index_bits() const;
+    size_t delta_size() const { return delta->size() + removed->size(); }
+    size_t rebuilds() const { return rebuild_count; }
+
+private:
+    typedef std::vector<uint64_t, TrackingAllocator<uint64_t, MEM_KEYS>> Bits;
+
+    struct Index : TrackedObject<Index, MEM_KEYS> {
+        size_t count = 0;
+        size_t table_size = 0;
+        size_t buckets = 0;
+        uint64_t seed = 0;
+        int pilot_bits = 0;
+        int remap_bits = 0;
+        int key_base = 0;
+        int key_bits = 0;
+        int value_base = 0;
+        int value_bits = 0;
+        Bits pilots;
+        Bits remap;
+        Bits keys;
+        Bits values;
+
+        size_t slot(int key) const;
+        bool get(int key, int& value) const;
+        int key_at(size_t slot) const;
+        int value_at(size_t slot) const;
+    };
+
+    static Index* build(const KeyList& entries);
+    static KeyList merge(const Index* base, const MapKeyStore* upserts, const MapKeyStore* tombstones);
+    bool lower_get(int key, int& value) const;
+    void maybe_rebuild();
+    void install();
+    void reset(Index* fresh);
+
+    Index* index;
+    // Fresh writes, and the sealed layer being merged in the background.
+    MapKeyStore* delta;
+    MapKeyStore* removed;
+    MapKeyStore* sealed_delta;
+    MapKeyStore* sealed_removed;
+    std::thread builder;
+    std::atomic<Index*> built;
+    size_t live;
+    size_t rebuild_count;
+};
+
+// Popularity estimate for TinyLFU admission: four rows of counters that
+// saturate at 15, all halved every 10 * capacity increments so that old
+// popularity fades.
+class FrequencySketch {
+public:
+    explicit FrequencySketch(size_t capacity);
+
+    void increment(int key);
+    int estimate(int key) const;
+
+private:
+    size_t slot(int key, int row) const;
+
+    std::vector<uint8_t, TrackingAllocator<uint8_t, MEM_KEYS>> counters;
+    size_t width;
+    size_t additions;
+    size_t sample;
+};
+
+// Bounded store for running the ring as a cache: at most `capacity` entries
+// under W-TinyLFU. New keys enter a small LRU window. The window's victim
+// only joins the main segmented LRU if the sketch rates it above the
+// probation victim. A hit in probation promotes to protected, whose overflow
+// drops back to probation. Each step is a hash lookup plus list splices.
+// Reads update recency and frequency, so even get() takes the store's mutex;
+// fenced reads only hold the range lock shared.
+class CacheKeyStore : public KeyStore, public TrackedObject<CacheKeyStore, MEM_KEYS> {
+public:
+    explicit CacheKeyStore(size_t capacity, int window_percent = CACHE_WINDOW_PERCENT);
+
+    bool get(int key, int& value) const override;
+    void put(int key, int value) override;
+    bool erase(int key) override;
+    size_t size() const override;
+    KeyList items() const override;
+    void clear() override;
+
+    uint64_t evictions() const;
+
+private:
+    enum Segment { WINDOW, PROBATION, PROTECTED };
+    struct Entry {
+        int key;
+        int value;
+        Segment segment;
+    };
+    typedef std::list<Entry, TrackingAllocator<Entry, MEM_KEYS>> Lru;
+
+    Lru& lru(Segment segment) const;
+    void touch(Lru::iterator it) const;
+    void drop(Lru::iterator it);
+    void evict_window();
+
+    size_t window_capacity;
+    size_t main_capacity;
+    size_t protected_capacity;
+    mutable Lru window_lru;
+    mutable Lru probation_lru;
+    mutable Lru protected_lru;
+    std::unordered_map<int, Lru::iterator, std::hash<int>, std::equal_to<int>,
+                       TrackingAllocator<std::pair<const int, Lru::iterator>, MEM_KEYS>> index;
+    mutable FrequencySketch sketch;
+    uint64_t evicted;
+    mutable std::mutex mutex;
+};
+
+typedef std::set<int, std::less<int>, TrackingAllocator<int, MEM_KEYS>> KeySet;
+
+// Immutable run of demoted entries, sorted by key, in a file mapped
+// read-only. The file is unlinked when the run is deleted.
+class ColdRun : public TrackedObject<ColdRun, MEM_KEYS> {
+public:
+    struct Record {
+        int32_t key;
+        int32_t value;
+    };
+
+    // Streams records, added in key order, to a new run file.
+    class Writer {
+    public:
+        Writer();
+        ~Writer();
+
+        void add(int key, int value);
+        // The finished run, or nullptr if nothing was added or writing failed.
+        ColdRun* finish();
+        bool ok() const { return !failed; }
+        size_t size() const { return count; }
+
+    private:
+        void flush();
+
+        std::string path;
+        int fd;
+        std::vector<Record> buffer;
+        size_t count;
+        bool failed;
+    };
+
+    static ColdRun* create(const KeyList& entries);
+    // Merges runs (later ones win), drops keys in `tombstones` and cuts the
+    // output every TIER_RUN_KEYS keys; `ok` is false if a write failed.
+    static std::vector<ColdRun*> merge(const std::vector<ColdRun*>& inputs, const KeySet& tombstones,
+                                       bool& ok);
+    ~ColdRun();
+
+    bool get(int key, int& value) const;
+    // Whether any key k in the run has in_interval(k, a, b, true).
+    bool intersects(int a, int b) const;
+    KeyList items() const;
+    size_t size() const { return count; }
+    const Record& at(size_t i) const { return records[i]; }
+    int first_key() const { return records[0].key; }
+    int last_key() const { return records[count - 1].key; }
+
+private:
+    ColdRun(const std::string& file, const Record* mapped, size_t entries);
+
+    std::string path;
+    const Record* records;
+    size_t count;
+};
+
+// Two-tier store for nodes whose keys outgrow memory. Recently used keys
+// stay in `hot`; TIER_DEMOTER demotes the least recently used ones to a
+// fresh ColdRun once hot exceeds TIER_HOT_CAPACITY. With more than
+// TIER_MAX_RUNS fresh runs it merges everything into `sorted`: runs of
+// TIER_RUN_KEYS consecutive keys that never share a key. A read that finds
+// a key in a run promotes it back to hot. Fresh runs shadow older fresh
+// runs and all sorted ones; `removed` holds tombstones for keys deleted
+// while still in a run.
+// move_range hands whole runs to another TieredKeyStore and only rewrites
+// the runs that straddle the range boundary; it locks both stores in
+// address order, so opposite moves between two nodes cannot deadlock.
+class TieredKeyStore : public KeyStore, public TrackedObject<TieredKeyStore, MEM_KEYS> {
+public:
+    TieredKeyStore();
+    ~TieredKeyStore() override;
+
+    bool get(int key, int& value) const override;
+    void put(int key, int value) override;
+    bool erase(int key) override;
+    size_t size() const override;
+    KeyList items() const override;
+    size_t move_range(KeyStore* target, int a, int b, std::vector<int>* moved = nullptr) override;
+    void clear() override;
+
+    // Blocks until hot is within capacity and the runs are merged.
+    void wait_for_demotion();
+    size_t hot_size() const;
+    size_t cold_runs() const;
+    uint64_t promotions() const { return promoted.load(); }
+    uint64_t runs_handed_over() const { return handed_over.load(); }
+
+private:
+    struct HotEntry {
+        int value;
+        uint64_t touched;
+    };
+
+    bool cold_get(int key, int& value) const;
+    KeyList merged_items() const;
+    bool intersects(int a, int b) const;
+    bool needs_work() const;
+    void wait_idle(std::unique_lock<std::mutex>& lock) const;
+    void request_work() const;
+    void work();
+    void demote(std::unique_lock<std::mutex>& lock);
+    void compact(std::unique_lock<std::mutex>& lock);
+
+    friend class TierDemoter;
+
+    mutable std::mutex mutex;
+    mutable std::condition_variable idle;
+    mutable std::map<int, HotEntry, std::less<int>,
+                     TrackingAllocator<std::pair<const int, HotEntry>, MEM_KEYS>> hot;
+    std::vector<ColdRun*> fresh;
+    std::vector<ColdRun*> sorted;
+    KeySet removed;
+    mutable uint64_t clock;
+    size_t live;
+    bool busy;
+    mutable bool queued;
+    bool spill_failed;
+    mutable std::atomic<uint64_t> promoted;
+    std::atomic<uint64_t> handed_over;
+};
+
+// One background thread serves every TieredKeyStore: stores queue
+// themselves when they need a demotion or compaction, and the thread takes
+// one step per store in turn, requeueing stores that still need work.
+// Stores call schedule() with their own mutex held; the thread never holds
+// its mutex while taking a store's.
+class TierDemoter {
+public:
+    TierDemoter() : current(nullptr), stopping(false) {}
+    ~TierDemoter();
+
+    void schedule(TieredKeyStore* store);
+    // Drops a store that is being destroyed, waiting out a step in progress.
+    void cancel(TieredKeyStore* store);
+
+private:
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::deque<TieredKeyStore*> queue;
+    TieredKeyStore* current;
+    bool stopping;
+    std::thread worker;
+};
+
+static TierDemoter TIER_DEMOTER;
+
+// Open-addressing hash store for owners written by many threads.
+// Slots are grouped by 16; each slot has a one-byte control tag (7 hash
+// bits, or EMPTY/DELETED/BUSY) packed eight to an atomic word, so a probe
+// compares a whole group's tags at once (SSE2 when available).
+// Reads take no locks: they pin the epoch, probe the tables and retry only
+// if a resize swapped the tables underneath them. Writers lock one of
+// KEY_STORE_STRIPES stripes chosen by key, so writers of different keys
+// proceed in parallel and claim slots with a CAS on the control word.
+// Slots are never reused after a delete, so a slot only ever holds one key.
+// When a table fills up, a bigger one is installed next to it and every
+// write moves KEY_STORE_MIGRATE_CHUNK slots across; a key is live in exactly
+// one of the two tables, so readers check the old table and then the new.
+class ConcurrentKeyStore : public KeyStore, public TrackedObject<ConcurrentKeyStore, MEM_KEYS> {
+public:
+    ConcurrentKeyStore();
+    ~ConcurrentKeyStore() override;
+
+    bool get(int key, int& value) const override;
+    void put(int key, int value) override;
+    bool erase(int key) override;
+    size_t size() const override { return live.load(); }
+    KeyList items() const override;
+
+private:
+    struct Table {
+        explicit Table(size_t capacity);
+        ~Table();
+
+        // Table object plus its arrays, for MEM_KEYS accounting.
+        static size_t table_bytes(size_t capacity);
+
+        size_t capacity;
+        std::atomic<uint64_t>* ctrl;
+        std::atomic<int>* keys;
+        std::atomic<int>* values;
+        std::atomic<size_t> used;
+        // Next slot of the predecessor table to move into this one.
+        std::atomic<size_t> migrate_cursor;
+    };
+
+    static const uint8_t EMPTY = 0x80;
+    static const uint8_t DELETED = 0xFE;
+    static const uint8_t BUSY = 0xFF;
+
+    static uint64_t hash(int key);
+    static uint8_t ctrl_byte(const Table* table, size_t slot);
+    static bool set_ctrl(Table* table, size_t slot, uint8_t expected, uint8_t desired);
+    static unsigned match_group(const Table* table, size_t group, uint8_t tag);
+    static long find_slot(const Table* table, int key);
+    static bool claim_slot(Table* table, int key, int value);
+    static void mark_deleted(Table* table, size_t slot);
+
+    std::mutex& stripe_for(int key) { return stripes[hash(key) % KEY_STORE_STRIPES]; }
+    void grow(Table* full);
+    void start_resize(Table* full);
+    void help_resize();
+    void finish_resize(Table* new_table);
+
+    std::atomic<Table*> current;
+    std::atomic<Table*> next;
+    std::atomic<size_t> live;
+    std::shared_mutex resize_mutex;
+    std::mutex stripes[KEY_STORE_STRIPES];
+};
+
+KeyStore* make_key_store(void* inline_storage = nullptr);
+
+// One entry per distinct finger target. `start` is the first finger start
+// that resolves to `target`; every later finger up to the next entry's start
+// resolves to the same node, so sparse rings store far fewer than M rows.
+struct Finger {
+    int start;
+    int id;
+    Node* target;
+};
+
+typedef std::vector<Finger, TrackingAllocator<Finger, MEM_ROUTING>> FingerList;
+
+struct FingerRow : public TrackedObject<FingerRow, MEM_ROUTING> {
+    FingerList fingers;
+};
+
+// Lookups read the current row through an atomic pointer and never block.
+// update() builds a complete new row and publishes it with a single swap, so
+// a reader sees either the old row or the new one, never a mix. Replaced
+// rows go to RECLAIMER because a reader may still be scanning them.
+class FingerTable {
+public:
+    explicit FingerTable(Node* node) : row(new FingerRow()), node(node) {}
+    ~FingerTable();
+
+    void update();
+    const FingerRow* snapshot() const {
+        return row.load(std::memory_order_acquire);
+    }
+    Node* entry(int i) const;
+    void pretty_print();
+
+    std::atomic<const FingerRow*> row;
+    Node* node;
+};
+
+typedef std::vector<Node*, TrackingAllocator<Node*, MEM_ROUTING>> RoutingList;
+
+struct KBucketRow : public TrackedObject<KBucketRow, MEM_ROUTING> {
+    KBucketRow() : buckets(M) {}
+    std::vector<RoutingList, TrackingAllocator<RoutingList, MEM_ROUTING>> buckets;
+};
+
+// Copy of DHT_NODES for readers that take no membership lock. Republished
+// by publish_members() under MEMBERSHIP_MUTEX after every change; the old
+// copy goes to RECLAIMER, so readers hold an EpochGuard.
+struct MemberList : public TrackedObject<MemberList, MEM_ROUTING> {
+    RoutingList nodes;
+};
+
+static std::atomic<const MemberList*> MEMBERS(new MemberList());
+
+// Kademlia routing state: bucket i holds up to KADEMLIA_K live nodes whose
+// XOR distance from the owner has its highest set bit at position i.
+// Published like FingerTable rows, so lookups never see a bucket that is
+// being rebuilt.
+class KBucketTable {
+public:
+    explicit KBucketTable(Node* node) : row(new KBucketRow()), node(node) {}
+    ~KBucketTable();
+
+    void update();
+    const KBucketRow* snapshot() const {
+        return row.load(std::memory_order_acquire);
+    }
+    Node* closest_to(int key);
+    void pretty_print();
+
+    std::atomic<const KBucketRow*> row;
+    Node* node;
+};
+
+struct SymphonyRow : public TrackedObject<SymphonyRow, MEM_ROUTING> {
+    SymphonyRow() : successor(nullptr), estimated_size(1) {}
+    Node* successor;
+    int estimated_size;
+    RoutingList links;
+};
+
+// Symphony small-world routing state: the ring successor plus
+// SYMPHONY_LINKS long links whose clockwise distances are drawn from a
+// harmonic distribution scaled by the estimated ring size. Published like
+// FingerTable rows.
+class SymphonyTable {
+public:
+    explicit SymphonyTable(Node* node) : row(new SymphonyRow()), node(node) {}
+    ~SymphonyTable();
+
+    void update();
+    const SymphonyRow* snapshot() const {
+        return row.load(std::memory_order_acquire);
+    }
+    int estimate_ring_size();
+    Node* closest_preceding_link(const SymphonyRow* current, int key) const;
+    void pretty_print();
+
+    std::atomic<const SymphonyRow*> row;
+    Node* node;
+};
+
+// A routing engine decides which node owns a key, how lookups travel between
+// nodes and how keys move on join/leave. Key stores and the benchmark harness
+// are shared between engines.
+class RoutingEngine {
+public:
+    virtual ~RoutingEngine() {}
+
+    virtual const char* name() const = 0;
+    virtual Node* owner_of(int key) = 0;
+    virtual std::pair<Node*, Path> find_key(Node* from, int key) = 0;
+    virtual size_t table_size(Node* node) const = 0;
+    virtual void rebuild() = 0;
+    virtual bool owns(Node* node, int key) = 0;
+    virtual void join(Node* node, Node* contact) = 0;
+    virtual void leave(Node* node) = 0;
+};
+
+class ChordEngine : public RoutingEngine {
+public:
+    const char* name() const override { return "chord"; }
+    Node* owner_of(int key) override;
+    std::pair<Node*, Path> find_key(Node* from, int key) override;
+    size_t table_size(Node* node) const override;
+    void rebuild() override;
+    bool owns(Node* node, int key) override;
+    void join(Node* node, Node* contact) override;
+    void leave(Node* node) override;
+};
+
+class KademliaEngine : public RoutingEngine {
+public:
+    const char* name() const override { return "kademlia"; }
+    Node* owner_of(int key) override;
+    std::pair<Node*, Path> find_key(Node* from, int key) override;
+    size_t table_size(Node* node) const override;
+    void rebuild() override;
+    bool owns(Node* node, int key) override;
+    void join(Node* node, Node* contact) override;
+    void leave(Node* node) override;
+};
+
+// Same successor ownership and key migration as Chord; only the routing
+// tables and the greedy next-hop choice differ.
+class SymphonyEngine : public ChordEngine {
+public:
+    const char* name() const override { return "symphony"; }
+    std::pair<Node*, Path> find_key(Node* from, int key) override;
+    size_t table_size(Node* node) const override;
+    void rebuild() override;
+    void join(Node* node, Node* contact) override;
+    void leave(Node* node) override;
+};
+
+static ChordEngine CHORD_ENGINE;
+static KademliaEngine KADEMLIA_ENGINE;
+static SymphonyEngine SYMPHONY_ENGINE;
+static RoutingEngine* ROUTING_ENGINE = &CHORD_ENGINE;
+
+void set_routing_engine(RoutingEngine* engine);
+
+Node::Node(int node_id)
+    : id(node_id), alive(false), epoch(0), range_start(node_id),
+      finger(new FingerTable(this)),
+      kbuckets(new KBucketTable(this)), symphony(new SymphonyTable(this)),
+      keys(make_key_store(inline_keys)), key_count(0), queue_depth(0) {}
+
+Node::~Node() {
+    if (finger) {
+        delete finger;
+    }
+    if (kbuckets) {
+        delete kbuckets;
+    }
+    if (symphony) {
+        delete symphony;
+    }
+    if (keys == reinterpret_cast<KeyStore*>(inline_keys)) {
+        memory_allocated(MEM_KEYS, sizeof(SmallKeyStore));
+        keys->~KeyStore();
+    } else if (keys) {
+        delete keys;
+    }
+}
+
+void Node::update_finger_table() {
+    finger->update();
+}
+
+Node* Node::get_successor() {
+    return finger->snapshot()->fingers[0].target;
+}
+
+Node* Node::closest_preceding_finger(int key) {
+    const FingerList& fingers = finger->snapshot()->fingers;
+    for (int i = static_cast<int>(fingers.size()) - 1; i >= 0; --i) {
+        if (fingers[i].target != this &&
+            in_interval(fingers[i].id, this->id, key, false) &&
+            fingers[i].target->alive) {
+            return fingers[i].target;
+        }
+    }
+    return this;
+}
+
+std::pair<Node*, Path> Node::find_key(int key) {
+    LatencyTimer timer(OP_FIND);
+    EpochGuard guard;
+    auto result = ROUTING_ENGINE->find_key(this, key);
+    if (PLACEMENT != PLACEMENT_SUCCESSOR) {
+        Node* holder = result.first->locate_key(key);
+        if (holder != result.first) {
+            result.first = holder;
+            result.second.push_back(holder->id);
+        }
+    }
+    METRICS.lookups.add();
+    METRICS.lookup_hops.add(result.second.size() - 1);
+    return result;
+}
+
+// A fenced write is retried at once; a write rejected by an overloaded
+// owner waits out an exponential backoff so the owner can drain. `attempt`
+// counts rejections only for WRITE_REJECTED.
+static void wait_before_retry(WriteState outcome, int attempt) {
+    if (outcome == WRITE_REJECTED) {
+        BACKPRESSURE_SIGNALS++;
+        int shift = std::min(attempt, BACKPRESSURE_MAX_SHIFT);
+        std::this_thread::sleep_for(std::chrono::microseconds(BACKPRESSURE_BASE_US << shift));
+    } else {
+        FENCED_WRITES++;
+        std::this_thread::yield();
+    }
+}
+
+// Counts a failed attempt and decides whether the write goes on: fenced
+// writes always do, rejected ones until WRITE_MAX_REJECTIONS is reached.
+static bool retry_write(WriteState outcome, int& fenced, int& rejected) {
+    if (outcome == WRITE_REJECTED) {
+        if (WRITE_MAX_REJECTIONS > 0 && rejected + 1 >= WRITE_MAX_REJECTIONS) {
+            BACKPRESSURE_SIGNALS++;
+            SHED_WRITES++;
+            return false;
+        }
+        wait_before_retry(outcome, rejected++);
+    } else {
+        wait_before_retry(outcome, fenced++);
+    }
+    return true;
+}
+
+// Writes are routed with the owner's epoch as a ticket; if ownership moved
+// before the owner applies them they are rejected and routed again. False
+// if the write was shed under backpressure.
+bool Node::insert_key(int key, int value) {
+    LatencyTimer timer(OP_INSERT);
+    EpochGuard guard;
+    METRICS.writes.add();
+    int fenced = 0;
+    int rejected = 0;
+    while (true) {
+        auto result = ROUTING_ENGINE->find_key(this, key);
+        Node* responsible = result.first;
+        uint64_t seen = responsible->epoch.load();
+        WriteState outcome = COALESCE_WRITES
+            ? responsible->submit_write(key, value, false, seen)
+            : (responsible->fenced_store(key, value, seen) ? WRITE_APPLIED : WRITE_FENCED);
+        if (outcome == WRITE_APPLIED) {
+            return true;
+        }
+        if (!retry_write(outcome, fenced, rejected)) {
+            return false;
+        }
+    }
+}
+
+bool Node::remove_key(int key) {
+    EpochGuard guard;
+    METRICS.writes.add();
+    int fenced = 0;
+    int rejected = 0;
+    while (true) {
+        auto result = ROUTING_ENGINE->find_key(this, key);
+        Node* responsible = result.first;
+        uint64_t seen = responsible->epoch.load();
+        WriteState outcome = COALESCE_WRITES
+            ? responsible->submit_write(key, 0, true, seen)
+            : (responsible->fenced_erase(key, seen) ? WRITE_APPLIED : WRITE_FENCED);
+        if (outcome == WRITE_APPLIED) {
+            return true;
+        }
+        if (!retry_write(outcome, fenced, rejected)) {
+            return false;
+        }
+    }
+}
+
+// Stores `value` (or erases the key) and reports the value it replaced, -1
+// if none, as one step on the owner. Blob writes use it so two writers of a
+// key never both see, and release, the same previous handle. It bypasses
+// write coalescing; false if the write was shed.
+bool Node::exchange_key(int key, int value, bool erase, int& previous) {
+    EpochGuard guard;
+    METRICS.writes.add();
+    int fenced = 0;
+    int rejected = 0;
+    while (true) {
+        auto result = ROUTING_ENGINE->find_key(this, key);
+        Node* responsible = result.first;
+        uint64_t seen = responsible->epoch.load();
+        WriteState outcome = responsible->fenced_exchange(key, value, erase, seen, previous);
+        if (outcome == WRITE_APPLIED) {
+            return true;
+        }
+        if (!retry_write(outcome, fenced, rejected)) {
+            return false;
+        }
+    }
+}
+
+// The previous blob, if any, loses the store's reference once the new
+// handle is in place.
+bool Node::insert_blob(int key, const char* data, size_t size) {
+    return insert_blob_handle(key, BLOBS.put(data, size));
+}
+
+// Stores a streamed value; false if the writer could not produce a blob.
+bool Node::insert_blob(int key, BlobWriter& value) {
+    int handle = value.finish();
+    if (handle < 0) {
+        return false;
+    }
+    return insert_blob_handle(key, handle);
+}
+
+// Takes over the caller's reference to `handle`, binding the blob to `key`.
+// If the write is shed the new blob is released and the old one kept.
+bool Node::insert_blob_handle(int key, int handle) {
+    if (handle < 0) {
+        return false;
+    }
+    BLOBS.bind(handle, key);
+    int previous = -1;
+    if (!exchange_key(key, handle, false, previous)) {
+        BLOBS.release(handle, key);
+        return false;
+    }
+    BLOBS.release(previous, key);
+    return true;
+}
+
+// A fenced read, so it cannot overlap an exchange of the same key; a handle
+// released right after the read fails acquire() instead of pinning a reused
+// slot.
+bool Node::get_blob(int key, BlobRef& blob) {
+    RoutedReply reply = route_operation(ROUTED_GET, key);
+    if (!reply.found) {
+        blob.reset();
+        return false;
+    }
+    return blob.acquire(reply.value, key);
+}
+
+// Compacts this node's store for read-mostly serving (see
+// EliasFanoKeyStore); the exclusive range lock keeps writers out meanwhile.
+void Node::freeze_keys() {
+    std::unique_lock<std::shared_mutex> range(range_mutex);
+    keys->freeze();
+}
+
+bool Node::remove_blob(int key) {
+    int handle = -1;
+    if (!exchange_key(key, 0, true, handle)) {
+        return false;
+    }
+    BLOBS.release(handle, key);
+    return true;
+}
+
+// The range lock is shared, so writers to one owner run in parallel; that
+// needs a thread-safe store (STORE_CONCURRENT) when several threads write.
+bool Node::fenced_store(int key, int value, uint64_t seen_epoch) {
+    std::shared_lock<std::shared_mutex> range(range_mutex);
+    if (epoch.load() != seen_epoch || !ROUTING_ENGINE->owns(this, key)) {
+        return false;
+    }
+    if (WAL && !WAL->append({{id, key, value, 0}})) {
+        return false;
+    }
+    store_key(key, value);
+    return true;
+}
+
+bool Node::fenced_erase(int key, uint64_t seen_epoch) {
+    std::shared_lock<std::shared_mutex> range(range_mutex);
+    if (epoch.load() != seen_epoch || !ROUTING_ENGINE->owns(this, key)) {
+        return false;
+    }
+    if (WAL && !WAL->append({{id, key, 0, 1}})) {
+        return false;
+    }
+    erase_key(key);
+    return true;
+}
+
+bool Node::fenced_get(int key, uint64_t seen_epoch, int& value, bool& found) {
+    std::shared_lock<std::shared_mutex> range(range_mutex);
+    if (epoch.load() != seen_epoch || !ROUTING_ENGINE->owns(this, key)) {
+        return false;
+    }
+    found = locate_key(key)->keys->get(key, value);
+    return true;
+}
+
+// Holds the range lock exclusively: the read of the old value and the write
+// must not interleave with another writer of the key. A log failure rejects
+// the write like an overloaded owner would.
+WriteState Node::fenced_exchange(int key, int value, bool erase, uint64_t seen_epoch, int& previous) {
+    std::unique_lock<std::shared_mutex> range(range_mutex);
+    if (epoch.load() != seen_epoch || !ROUTING_ENGINE->owns(this, key)) {
+        return WRITE_FENCED;
+    }
+    if (WAL && !WAL->append({{id, key, value, erase ? 1 : 0}})) {
+        return WRITE_REJECTED;
+    }
+    previous = -1;
+    locate_key(key)->keys->get(key, previous);
+    if (erase) {
+        erase_key(key);
+    } else {
+        store_key(key, value);
+    }
+    return WRITE_APPLIED;
+}
+
+// Simulated one-way delay between two nodes: each id sits at a fixed
+// pseudo-random point in a 100 x 100 ms square, plus 0.5 ms per message.
+double link_latency_ms(int a, int b) {
+    if (a == b) {
+        return 0;
+    }
+    double dx = (mix64(2 * a) % 10000 - double(mix64(2 * b) % 10000)) / 100;
+    double dy = (mix64(2 * a + 1) % 10000 - double(mix64(2 * b + 1) % 10000)) / 100;
+    return 0.5 + std::sqrt(dx * dx + dy * dy);
+}
+
+// Adds the messages and latency of carrying one operation along `path`
+// (client first, owner last) under ROUTING_MODE.
+void charge_route(const Path& path, RoutedReply& reply) {
+    int hops = static_cast<int>(path.size()) - 1;
+    int client = path.front();
+    int owner = path.back();
+    double forwarded = 0;
+    double queried = 0;
+    for (int i = 1; i <= hops; i++) {
+        forwarded += link_latency_ms(path[i - 1], path[i]);
+        queried += 2 * link_latency_ms(client, path[i]);
+    }
+    switch (ROUTING_MODE) {
+    case ROUTE_LOOKUP_THEN_OP:
+        reply.messages += hops > 0 ? 2 * hops + 2 : 0;
+        reply.latency_ms += queried + 2 * link_latency_ms(client, owner);
+        break;
+    case ROUTE_ITERATIVE:
+        reply.messages += 2 * hops;
+        reply.latency_ms += queried;
+        break;
+    case ROUTE_RECURSIVE:
+        reply.messages += 2 * hops;
+        reply.latency_ms += 2 * forwarded;
+        break;
+    case ROUTE_SEMI_RECURSIVE:
+        reply.messages += hops > 0 ? hops + 1 : 0;
+        reply.latency_ms += forwarded + link_latency_ms(owner, client);
+        break;
+    }
+}
+
+// Routes a get, put or remove to the owner of `key` and applies it there,
+// with ROUTING_MODE deciding what that costs on the wire. A fenced attempt
+// is retried and its messages count too. Writes are applied directly, not
+// through the coalescing inbox.
+RoutedReply Node::route_operation(RoutedOpKind kind, int key, int value) {
+    EpochGuard guard;
+    if (kind != ROUTED_GET) {
+        METRICS.writes.add();
+    }
+    RoutedReply reply{false, 0, nullptr, 0, 0, 0.0};
+    int attempt = 0;
+    while (true) {
+        auto result = ROUTING_ENGINE->find_key(this, key);
+        Node* owner = result.first;
+        uint64_t seen = owner->epoch.load();
+        charge_route(result.second, reply);
+        reply.owner = owner;
+        // Fenced retries route again, so hops add up like messages and latency.
+        reply.hops += static_cast<int>(result.second.size()) - 1;
+        bool applied = kind == ROUTED_GET ? owner->fenced_get(key, seen, reply.value, reply.found)
+                     : kind == ROUTED_PUT ? owner->fenced_store(key, value, seen)
+                     : owner->fenced_erase(key, seen);
+        if (applied) {
+            return reply;
+        }
+        wait_before_retry(WRITE_FENCED, attempt++);
+    }
+}
+
+void Node::erase_key(int key) {
+    Node* holder = locate_key(key);
+    holder->keys->erase(key);
+    holder->count_keys();
+    overflow.erase(key);
+    redirects.erase(key);
+}
+
+// Queues the write and waits for a batch to apply or fence it. A waiting
+// writer that finds the drain lock free becomes the combiner for everyone
+// queued so far, so a busy owner does one range lock and one log append
+// per batch instead of per write.
+WriteState Node::submit_write(int key, int value, bool erase, uint64_t seen_epoch) {
+    int depth = queue_depth.fetch_add(1);
+    if (INBOX_CAPACITY > 0 && depth >= INBOX_CAPACITY) {
+        queue_depth--;
+        return WRITE_REJECTED;
+    }
+    PendingWrite write(key, value, erase, seen_epoch);
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        inbox.push_back(&write);
+    }
+    while (write.state.load(std::memory_order_acquire) == WRITE_PENDING) {
+        std::unique_lock<std::mutex> drain(drain_mutex, std::try_to_lock);
+        if (drain.owns_lock()) {
+            drain_inbox();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    return static_cast<WriteState>(write.state.load());
+}
+
+// Batches are sorted by key (stable, so writes to one key keep their queue
+// order), logged with a single append and only then acknowledged.
+void Node::drain_inbox() {
+    std::vector<PendingWrite*> batch;
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex);
+        batch.swap(inbox);
+    }
+    if (batch.empty()) {
+        return;
+    }
+    queue_depth -= static_cast<int>(batch.size());
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](PendingWrite* a, PendingWrite* b){ return a->key < b->key; });
+
+    std::vector<bool> accepted(batch.size());
+    bool logged = true;
+    {
+        std::unique_lock<std::shared_mutex> range(range_mutex);
+        std::vector<WalRecord> records;
+        for (size_t i = 0; i < batch.size(); i++) {
+            PendingWrite* write = batch[i];
+            accepted[i] = epoch.load() == write->seen_epoch &&
+                          ROUTING_ENGINE->owns(this, write->key);
+            if (accepted[i]) {
+                records.push_back({id, write->key, write->value, write->erase ? 1 : 0});
+            }
+        }
+        // A batch that could not be logged is neither applied nor
+        // acknowledged; its writers back off as if the owner were full.
+        logged = !WAL || records.empty() || WAL->append(records);
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (!accepted[i] || !logged) {
+                continue;
+            }
+            if (batch[i]->erase) {
+                erase_key(batch[i]->key);
+            } else {
+                store_key(batch[i]->key, batch[i]->value);
+            }
+        }
+    }
+    for (size_t i = 0; i < batch.size(); i++) {
+        WriteState state = !accepted[i] ? WRITE_FENCED : logged ? WRITE_APPLIED : WRITE_REJECTED;
+        batch[i]->state.store(state, std::memory_order_release);
+    }
+}
+
+// Called on the key's primary owner. With bounded-load placement every node
+// accepts at most ceil((1 + epsilon) * average) keys and the rest walk on to
+// the first successor with spare capacity. With two-choices placement a new
+// key goes to whichever of this node and the owner of its second hash holds
+// fewer keys.
+void Node::store_key(int key, int value) {
+    if (PLACEMENT == PLACEMENT_SUCCESSOR) {
+        keys->put(key, value);
+        count_keys();
+        return;
+    }
+
+    Node* holder = locate_key(key);
+    if (holder->keys->contains(key)) {
+        holder->keys->put(key, value);
+        holder->count_keys();
+        return;
+    }
+
+    if (PLACEMENT == PLACEMENT_TWO_CHOICES) {
+        Node* second = ROUTING_ENGINE->owner_of(second_choice_hash(key));
+        if (second != this && second->keys->size() < keys->size()) {
+            second->keys->put(key, value);
+            second->count_keys();
+            redirects[key] = second;
+        } else {
+            keys->put(key, value);
+            count_keys();
+        }
+        return;
+    }
+
+    double average = static_cast<double>(count_stored_keys() + 1) / DHT_NODES.size();
+    size_t capacity = static_cast<size_t>(
+        std::ceil((1.0 + BOUNDED_LOAD_EPSILON) * average));
+    holder = this;
+    int hops = 0;
+    while (holder->keys->size() >= capacity &&
+           hops + 1 < static_cast<int>(DHT_NODES.size())) {
+        holder = get_next_node(holder);
+        hops++;
+    }
+    holder->keys->put(key, value);
+    holder->count_keys();
+    if (hops > 0) {
+        overflow[key] = static_cast<unsigned char>(hops);
+    }
+}
+
+void Node::count_keys() {
+    key_count.store(keys->size(), std::memory_order_relaxed);
+}
+
+// Called on the key's primary owner; returns the node that stores the key,
+// or this node if nothing was redirected.
+Node* Node::locate_key(int key, int* extra_probes) {
+    Node* holder = this;
+    int hops = 0;
+    auto it = overflow.find(key);
+    if (it != overflow.end()) {
+        for (hops = 0; hops < it->second; hops++) {
+            holder = get_next_node(holder);
+        }
+    }
+    auto redirect = redirects.find(key);
+    if (redirect != redirects.end()) {
+        holder = redirect->second;
+        hops = 1;
+    }
+    if (extra_probes) {
+        *extra_probes = hops;
+    }
+    return holder;
+}
+
+// Membership changes pin the epoch too: the successor they lock may itself
+// be leaving concurrently.
+void Node::join(Node* contact) {
+    LatencyTimer timer(OP_JOIN);
+    EpochGuard guard;
+    ROUTING_ENGINE->join(this, contact);
+    if (PLACEMENT != PLACEMENT_SUCCESSOR) {
+        rebalance_placement();
+    }
+}
+
+// Once the routing state no longer points at this node it is handed to
+// RECLAIMER; the caller must not touch it afterwards.
+void Node::leave() {
+    LatencyTimer timer(OP_LEAVE);
+    EpochGuard guard;
+    ROUTING_ENGINE->leave(this);
+    alive = false;
+    if (PLACEMENT != PLACEMENT_SUCCESSOR) {
+        rebalance_placement();
+    }
+    RECLAIMER.retire(this);
+}
+
+EpochRecord* EpochReclaimer::local_record() {
+    struct Handle {
+        EpochRecord* record = nullptr;
+        ~Handle() {
+            if (record) {
+                record->in_use = false;
+            }
+        }
+    };
+    thread_local Handle handle;
+    if (!handle.record) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (EpochRecord* record : records) {
+            bool expected = false;
+            if (record->in_use.compare_exchange_strong(expected, true)) {
+                handle.record = record;
+                break;
+            }
+        }
+        if (!handle.record) {
+            EpochRecord* record = new EpochRecord();
+            record->epoch = 0;
+            record->active = false;
+            record->in_use = true;
+            record->depth = 0;
+            records.push_back(record);
+            handle.record = record;
+        }
+    }
+    return handle.record;
+}
+
+void EpochReclaimer::enter() {
+    EpochRecord* record = local_record();
+    if (record->depth++ == 0) {
+        record->epoch.store(global_epoch.load());
+        record->active.store(true);
+    }
+}
+
+void EpochReclaimer::exit() {
+    EpochRecord* record = local_record();
+    if (--record->depth == 0) {
+        record->active.store(false, std::memory_order_release);
+    }
+}
+
+void EpochReclaimer::retire_object(void* object, void (*deleter)(void*)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    limbo.push_back({object, deleter, global_epoch.load()});
+    retired_total++;
+    if (limbo.size() >= RECLAIM_BATCH) {
+        reclaim_locked();
+    }
+}
+
+void EpochReclaimer::reclaim_locked() {
+    unsigned long epoch = global_epoch.load();
+    bool quiescent = true;
+    for (EpochRecord* record : records) {
+        if (record->active.load() && record->epoch.load() != epoch) {
+            quiescent = false;
+            break;
+        }
+    }
+    if (quiescent) {
+        global_epoch.store(++epoch);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < limbo.size(); i++) {
+        if (limbo[i].epoch + 2 <= epoch) {
+            limbo[i].deleter(limbo[i].object);
+            reclaimed_total++;
+        } else {
+            limbo[kept++] = limbo[i];
+        }
+    }
+    limbo.resize(kept);
+}
+
+// Frees everything still waiting; only valid when no reader is running.
+void EpochReclaimer::drain() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (RetiredObject& retired : limbo) {
+        retired.deleter(retired.object);
+        reclaimed_total++;
+    }
+    limbo.clear();
+}
+
+size_t EpochReclaimer::pending() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return limbo.size();
+}
+
+KeyList KeyStore::extract_range(int a, int b) {
+    KeyList extracted;
+    for (auto& kv : items()) {
+        if (in_interval(kv.first, a, b, true)) {
+            erase(kv.first);
+            extracted.push_back(kv);
+        }
+    }
+    return extracted;
+}
+
+size_t KeyStore::move_range(KeyStore* target, int a, int b, std::vector<int>* moved) {
+    KeyList extracted = extract_range(a, b);
+    for (auto& kv : extracted) {
+        target->put(kv.first, kv.second);
+        if (moved) {
+            moved->push_back(kv.first);
+        }
+    }
+    return extracted.size();
+}
+
+void KeyStore::clear() {
+    for (auto& kv : items()) {
+        erase(kv.first);
+    }
+}
+
+bool MapKeyStore::get(int key, int& value) const {
+    auto it = data.find(key);
+    if (it == data.end()) {
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+void MapKeyStore::put(int key, int value) {
+    data[key] = value;
+}
+
+bool MapKeyStore::erase(int key) {
+    return data.erase(key) > 0;
+}
+
+KeyList MapKeyStore::items() const {
+    return KeyList(data.begin(), data.end());
+}
+
+KeyList MapKeyStore::extract_range(int a, int b) {
+    KeyList extracted;
+    for (auto it = data.begin(); it != data.end();) {
+        if (in_interval(it->first, a, b, true)) {
+            extracted.push_back(*it);
+            it = data.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return extracted;
+}
+
+bool SmallKeyStore::get(int key, int& value) const {
+    if (spilled) {
+        return spilled->get(key, value);
+    }
+    for (int i = 0; i < count; i++) {
+        if (keys[i] == key) {
+            value = values[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+void SmallKeyStore::put(int key, int value) {
+    if (spilled) {
+        spilled->put(key, value);
+        return;
+    }
+    int at = 0;
+    while (at < count && keys[at] < key) {
+        at++;
+    }
+    if (at < count && keys[at] == key) {
+        values[at] = value;
+        return;
+    }
+    if (count == SMALL_STORE_CAPACITY) {
+        spill();
+        spilled->put(key, value);
+        return;
+    }
+    for (int i = count; i > at; i--) {
+        keys[i] = keys[i - 1];
+        values[i] = values[i - 1];
+    }
+    keys[at] = key;
+    values[at] = value;
+    count++;
+}
+
+bool SmallKeyStore::erase(int key) {
+    if (spilled) {
+        bool erased = spilled->erase(key);
+        maybe_unspill();
+        return erased;
+    }
+    for (int i = 0; i < count; i++) {
+        if (keys[i] == key) {
+            for (int j = i + 1; j < count; j++) {
+                keys[j - 1] = keys[j];
+                values[j - 1] = values[j];
+            }
+            count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+KeyList SmallKeyStore::items() const {
+    if (spilled) {
+        return spilled->items();
+    }
+    KeyList entries;
+    for (int i = 0; i < count; i++) {
+        entries.push_back({keys[i], values[i]});
+    }
+    return entries;
+}
+
+KeyList SmallKeyStore::extract_range(int a, int b) {
+    if (spilled) {
+        KeyList extracted = spilled->extract_range(a, b);
+        maybe_unspill();
+        return extracted;
+    }
+    KeyList extracted;
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (in_interval(keys[i], a, b, true)) {
+            extracted.push_back({keys[i], values[i]});
+        } else {
+            keys[kept] = keys[i];
+            values[kept] = values[i];
+            kept++;
+        }
+    }
+    count = kept;
+    return extracted;
+}
+
+void SmallKeyStore::clear() {
+    delete spilled;
+    spilled = nullptr;
+    count = 0;
+}
+
+void SmallKeyStore::spill() {
+    spilled = new MapKeyStore();
+    for (int i = 0; i < count; i++) {
+        spilled->put(keys[i], values[i]);
+    }
+    count = 0;
+}
+
+void SmallKeyStore::maybe_unspill() {
+    if (spilled->size() > static_cast<size_t>(SMALL_STORE_CAPACITY / 2)) {
+        return;
+    }
+    count = 0;
+    for (auto& kv : spilled->items()) {
+        keys[count] = kv.first;
+        values[count] = kv.second;
+        count++;
+    }
+    delete spilled;
+    spilled = nullptr;
+}
+
+template <typename Words>
+void write_bits(Words& words, size_t pos, int width, uint64_t value) {
+    if (width == 0) {
+        return;
+    }
+    if (width < 64) {
+        value &= (uint64_t(1) << width) - 1;
+    }
+    size_t word = pos / 64;
+    int shift = pos % 64;
+    words[word] |= value << shift;
+    if (shift + width > 64) {
+        words[word + 1] |= value >> (64 - shift);
+    }
+}
+
+template <typename Words>
+uint64_t read_bits(const Words& words, size_t pos, int width) {
+    if (width == 0) {
+        return 0;
+    }
+    size_t word = pos / 64;
+    int shift = pos % 64;
+    uint64_t bits = words[word] >> shift;
+    if (shift + width > 64) {
+        bits |= words[word + 1] << (64 - shift);
+    }
+    return width == 64 ? bits : bits & ((uint64_t(1) << width) - 1);
+}
+
+int bit_width(uint64_t value) {
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+bool EliasFanoKeyStore::get(int key, int& value) const {
+    if (thawed) {
+        return thawed->get(key, value);
+    }
+    bool found = false;
+    size_t index = lower_bound(key, found);
+    if (found) {
+        value = value_base + static_cast<int>(read_bits(values, index * value_bits, value_bits));
+    }
+    return found;
+}
+
+void EliasFanoKeyStore::put(int key, int value) {
+    thaw();
+    thawed->put(key, value);
+}
+
+bool EliasFanoKeyStore::erase(int key) {
+    if (!thawed && !contains(key)) {
+        return false;
+    }
+    thaw();
+    return thawed->erase(key);
+}
+
+KeyList EliasFanoKeyStore::items() const {
+    if (thawed) {
+        return thawed->items();
+    }
+    KeyList entries;
+    entries.reserve(count);
+    size_t index = 0;
+    for (size_t word = 0; index < count; word++) {
+        for (uint64_t ones = uppers[word]; ones != 0; ones &= ones - 1) {
+            int high = static_cast<int>(word * 64 + __builtin_ctzll(ones) - index);
+            int key = (high << low_bits) | static_cast<int>(read_bits(lows, index * low_bits, low_bits));
+            int value = value_base + static_cast<int>(read_bits(values, index * value_bits, value_bits));
+            entries.push_back({key, value});
+            index++;
+        }
+    }
+    return entries;
+}
+
+KeyList EliasFanoKeyStore::extract_range(int a, int b) {
+    if (thawed) {
+        return thawed->extract_range(a, b);
+    }
+    KeyList extracted;
+    KeyList kept;
+    for (auto& kv : items()) {
+        (in_interval(kv.first, a, b, true) ? extracted : kept).push_back(kv);
+    }
+    if (!extracted.empty()) {
+        encode(kept);
+    }
+    return extracted;
+}
+
+void EliasFanoKeyStore::clear() {
+    delete thawed;
+    thawed = nullptr;
+    encode(KeyList());
+}
+
+void EliasFanoKeyStore::freeze() {
+    if (thawed) {
+        encode(thawed->items());
+        delete thawed;
+        thawed = nullptr;
+    }
+}
+
+size_t EliasFanoKeyStore::key_bits() const {
+    return count * low_bits + (count > 0 ? uppers.size() * 64 : 0);
+}
+
+size_t EliasFanoKeyStore::encoded_bytes() const {
+    return sizeof(*this) + (lows.size() + uppers.size() + values.size()) * sizeof(uint64_t) +
+           zero_samples.size() * sizeof(uint32_t);
+}
+
+void EliasFanoKeyStore::encode(const KeyList& entries) {
+    count = entries.size();
+    lows.clear();
+    uppers.clear();
+    values.clear();
+    zero_samples.clear();
+    if (count == 0) {
+        low_bits = value_bits = value_base = 0;
+        return;
+    }
+    uint64_t universe = uint64_t(entries.back().first) + 1;
+    low_bits = universe > count ? bit_width(universe / count) - 1 : 0;
+    size_t upper_size = count + (universe >> low_bits) + 1;
+    int lowest = entries[0].second;
+    int highest = entries[0].second;
+    for (auto& kv : entries) {
+        lowest = std::min(lowest, kv.second);
+        highest = std::max(highest, kv.second);
+    }
+    value_base = lowest;
+    value_bits = bit_width(uint64_t(int64_t(highest) - lowest));
+
+    lows.assign((count * low_bits + 63) / 64 + 1, 0);
+    uppers.assign((upper_size + 63) / 64, 0);
+    values.assign((count * value_bits + 63) / 64 + 1, 0);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = entries[i].first;
+        write_bits(lows, i * low_bits, low_bits, key);
+        size_t pos = (key >> low_bits) + i;
+        uppers[pos / 64] |= uint64_t(1) << (pos % 64);
+        write_bits(values, i * value_bits, value_bits, uint64_t(int64_t(entries[i].second) - value_base));
+    }
+    size_t zeros = 0;
+    for (size_t word = 0; word < uppers.size(); word++) {
+        for (uint64_t free = ~uppers[word]; free != 0; free &= free - 1) {
+            if (zeros++ % EF_SELECT_SAMPLE == 0) {
+                zero_samples.push_back(static_cast<uint32_t>(word * 64 + __builtin_ctzll(free)));
+            }
+        }
+    }
+}
+
+void EliasFanoKeyStore::thaw() {
+    if (thawed) {
+        return;
+    }
+    MapKeyStore* store = new MapKeyStore();
+    for (auto& kv : items()) {
+        store->put(kv.first, kv.second);
+    }
+    encode(KeyList());
+    thawed = store;
+}
+
+// Position of the zero with the given rank in `uppers`: jump to the nearest
+// sample, skip whole words by popcount, then clear set bits inside the last.
+size_t EliasFanoKeyStore::select_zero(size_t rank) const {
+    size_t pos = zero_samples[rank / EF_SELECT_SAMPLE];
+    size_t remaining = rank % EF_SELECT_SAMPLE;
+    size_t word = pos / 64;
+    uint64_t zeros = ~uppers[word] & (~uint64_t(0) << (pos % 64));
+    while (static_cast<size_t>(__builtin_popcountll(zeros)) <= remaining) {
+        remaining -= __builtin_popcountll(zeros);
+        zeros = ~uppers[++word];
+    }
+    for (; remaining > 0; remaining--) {
+        zeros &= zeros - 1;
+    }
+    return word * 64 + __builtin_ctzll(zeros);
+}
+
+// Index of the first key >= `key`; `found` reports an exact match.
+size_t EliasFanoKeyStore::lower_bound(int key, bool& found) const {
+    found = false;
+    if (count == 0 || key < 0) {
+        return 0;
+    }
+    size_t high = static_cast<size_t>(key) >> low_bits;
+    size_t buckets = uppers.size() * 64 - count;
+    if (high >= buckets) {
+        return count;
+    }
+    uint64_t low = static_cast<uint64_t>(key) & ((uint64_t(1) << low_bits) - 1);
+    size_t pos = high == 0 ? 0 : select_zero(high - 1) + 1;
+    size_t index = pos - high;
+    while (index < count && upper_bit(pos)) {
+        uint64_t candidate = read_bits(lows, index * low_bits, low_bits);
+        if (candidate >= low) {
+            found = candidate == low;
+            return index;
+        }
+        pos++;
+        index++;
+    }
+    return index;
+}
+
+uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t mph_key_hash(int key, uint64_t seed) {
+    return mix64(static_cast<uint32_t>(key) ^ (seed * 0x9e3779b97f4a7c15ull));
+}
+
+size_t mph_position(uint64_t hash, uint64_t pilot, size_t table_size) {
+    return mix64(hash ^ mix64(pilot + 1)) % table_size;
+}
+
+size_t PerfectHashKeyStore::Index::slot(int key) const {
+    uint64_t hash = mph_key_hash(key, seed);
+    uint64_t pilot = read_bits(pilots, (hash % buckets) * pilot_bits, pilot_bits);
+    size_t position = mph_position(hash, pilot, table_size);
+    if (position >= count) {
+        position = read_bits(remap, (position - count) * remap_bits, remap_bits);
+    }
+    return position;
+}
+
+bool PerfectHashKeyStore::Index::get(int key, int& value) const {
+    if (count == 0) {
+        return false;
+    }
+    size_t at = slot(key);
+    if (key_at(at) != key) {
+        return false;
+    }
+    value = value_at(at);
+    return true;
+}
+
+int PerfectHashKeyStore::Index::key_at(size_t slot) const {
+    return key_base + static_cast<int>(read_bits(keys, slot * key_bits, key_bits));
+}
+
+int PerfectHashKeyStore::Index::value_at(size_t slot) const {
+    return value_base + static_cast<int>(read_bits(values, slot * value_bits, value_bits));
+}
+
+PerfectHashKeyStore::PerfectHashKeyStore()
+    : index(build(KeyList())), delta(new MapKeyStore()), removed(new MapKeyStore()),
+      sealed_delta(nullptr), sealed_removed(nullptr), built(nullptr), live(0), rebuild_count(0) {}
+
+PerfectHashKeyStore::~PerfectHashKeyStore() {
+    if (builder.joinable()) {
+        builder.join();
+    }
+    delete built.load();
+    delete index;
+    delete delta;
+    delete removed;
+    delete sealed_delta;
+    delete sealed_removed;
+}
+
+bool PerfectHashKeyStore::get(int key, int& value) const {
+    if (removed->contains(key)) {
+        return false;
+    }
+    return delta->get(key, value) || lower_get(key, value);
+}
+
+bool PerfectHashKeyStore::lower_get(int key, int& value) const {
+    if (sealed_removed && sealed_removed->contains(key)) {
+        return false;
+    }
+    if (sealed_delta && sealed_delta->get(key, value)) {
+        return true;
+    }
+    return index->get(key, value);
+}
+
+void PerfectHashKeyStore::put(int key, int value) {
+    install();
+    int old;
+    if (!get(key, old)) {
+        live++;
+    }
+    removed->erase(key);
+    delta->put(key, value);
+    maybe_rebuild();
+}
+
+bool PerfectHashKeyStore::erase(int key) {
+    install();
+    int old;
+    if (!get(key, old)) {
+        return false;
+    }
+    live--;
+    delta->erase(key);
+    if (lower_get(key, old)) {
+        removed->put(key, 0);
+    }
+    maybe_rebuild();
+    return true;
+}
+
+KeyList PerfectHashKeyStore::items() const {
+    KeyList base = merge(index, sealed_delta, sealed_removed);
+    std::map<int,int> merged(base.begin(), base.end());
+    for (auto& kv : removed->items()) {
+        merged.erase(kv.first);
+    }
+    for (auto& kv : delta->items()) {
+        merged[kv.first] = kv.second;
+    }
+    return KeyList(merged.begin(), merged.end());
+}
+
+// Migration re-indexes what stays behind in place instead of leaving a
+// tombstone per extracted key.
+KeyList PerfectHashKeyStore::extract_range(int a, int b) {
+    wait_for_rebuild();
+    KeyList extracted;
+    KeyList kept;
+    for (auto& kv : items()) {
+        (in_interval(kv.first, a, b, true) ? extracted : kept).push_back(kv);
+    }
+    if (!extracted.empty()) {
+        reset(build(kept));
+    }
+    return extracted;
+}
+
+void PerfectHashKeyStore::clear() {
+    wait_for_rebuild();
+    reset(build(KeyList()));
+}
+
+void PerfectHashKeyStore::freeze() {
+    wait_for_rebuild();
+    if (delta_size() > 0) {
+        reset(build(items()));
+    }
+}
+
+void PerfectHashKeyStore::wait_for_rebuild() {
+    if (builder.joinable()) {
+        builder.join();
+    }
+    install();
+}
+
+size_t PerfectHashKeyStore::index_bits() const {
+    return index->buckets * index->pilot_bits + (index->table_size - index->count) * index->remap_bits;
+}
+
+void PerfectHashKeyStore::reset(Index* fresh) {
+    delete index;
+    index = fresh;
+    delta->clear();
+    removed->clear();
+    live = fresh->count;
+}
+
+// Seals the delta and merges it in the background. The builder only reads
+// the old index and the sealed layer, which stay untouched until install().
+void PerfectHashKeyStore::maybe_rebuild() {
+    if (sealed_delta || delta_size() <= std::max(MPH_DELTA_LIMIT, index->count / 16)) {
+        return;
+    }
+    sealed_delta = delta;
+    sealed_removed = removed;
+    delta = new MapKeyStore();
+    removed = new MapKeyStore();
+    const Index* base = index;
+    const MapKeyStore* upserts = sealed_delta;
+    const MapKeyStore* tombstones = sealed_removed;
+    builder = std::thread([this, base, upserts, tombstones]() {
+        built.store(build(merge(base, upserts, tombstones)));
+    });
+}
+
+void PerfectHashKeyStore::install() {
+    if (!sealed_delta || built.load() == nullptr) {
+        return;
+    }
+    if (builder.joinable()) {
+        builder.join();
+    }
+    delete index;
+    index = built.exchange(nullptr);
+    delete sealed_delta;
+    delete sealed_removed;
+    sealed_delta = nullptr;
+    sealed_removed = nullptr;
+    rebuild_count++;
+}
+
+KeyList PerfectHashKeyStore::merge(const Index* base, const MapKeyStore* upserts,
+                                   const MapKeyStore* tombstones) {
+    std::map<int,int> merged;
+    for (size_t slot = 0; slot < base->count; slot++) {
+        merged[base->key_at(slot)] = base->value_at(slot);
+    }
+    if (tombstones) {
+        for (auto& kv : tombstones->items()) {
+            merged.erase(kv.first);
+        }
+    }
+    if (upserts) {
+        for (auto& kv : upserts->items()) {
+            merged[kv.first] = kv.second;
+        }
+    }
+    return KeyList(merged.begin(), merged.end());
+}
+
+PerfectHashKeyStore::Index* PerfectHashKeyStore::build(const KeyList& entries) {
+    Index* index = new Index();
+    size_t n = entries.size();
+    index->count = n;
+    if (n == 0) {
+        return index;
+    }
+    size_t table_size = std::max(n, static_cast<size_t>(std::ceil(n / MPH_LOAD_FACTOR)));
+    size_t buckets = (n + MPH_BUCKET_SIZE - 1) / MPH_BUCKET_SIZE;
+    std::vector<uint64_t> hashes(n);
+    std::vector<uint64_t> pilots(buckets);
+    std::vector<size_t> slots(n);
+    std::vector<size_t> remap(table_size - n);
+    for (uint64_t seed = 1;; seed++) {
+        std::vector<std::vector<size_t>> members(buckets);
+        for (size_t i = 0; i < n; i++) {
+            hashes[i] = mph_key_hash(entries[i].first, seed);
+            members[hashes[i] % buckets].push_back(i);
+        }
+        std::vector<size_t> order(buckets);
+        for (size_t b = 0; b < buckets; b++) {
+            order[b] = b;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+            return members[x].size() > members[y].size();
+        });
+
+        std::vector<bool> taken(table_size);
+        std::vector<size_t> positions;
+        bool placed_all = true;
+        for (size_t b : order) {
+            if (members[b].empty()) {
+                break;
+            }
+            uint64_t pilot = 0;
+            for (; pilot < MPH_MAX_PILOT; pilot++) {
+                positions.clear();
+                for (size_t i : members[b]) {
+                    size_t position = mph_position(hashes[i], pilot, table_size);
+                    if (taken[position] ||
+                        std::find(positions.begin(), positions.end(), position) != positions.end()) {
+                        break;
+                    }
+                    positions.push_back(position);
+                }
+                if (positions.size() == members[b].size()) {
+                    break;
+                }
+            }
+            if (pilot == MPH_MAX_PILOT) {
+                placed_all = false;
+                break;
+            }
+            pilots[b] = pilot;
+            for (size_t k = 0; k < positions.size(); k++) {
+                taken[positions[k]] = true;
+                slots[members[b][k]] = positions[k];
+            }
+        }
+        if (placed_all) {
+            index->seed = seed;
+            size_t hole = 0;
+            for (size_t position = n; position < table_size; position++) {
+                if (taken[position]) {
+                    while (taken[hole]) {
+                        hole++;
+                    }
+                    remap[position - n] = hole++;
+                }
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (slots[i] >= n) {
+                    slots[i] = remap[slots[i] - n];
+                }
+            }
+            break;
+        }
+    }
+
+    index->table_size = table_size;
+    index->buckets = buckets;
+    index->pilot_bits = bit_width(*std::max_element(pilots.begin(), pilots.end()));
+    index->remap_bits = bit_width(n - 1);
+    int lowest_key = entries.front().first;
+    int highest_key = entries.back().first;
+    int lowest = entries[0].second;
+    int highest = entries[0].second;
+    for (auto& kv : entries) {
+        lowest_key = std::min(lowest_key, kv.first);
+        highest_key = std::max(highest_key, kv.first);
+        lowest = std::min(lowest, kv.second);
+        highest = std::max(highest, kv.second);
+    }
+    index->key_base = lowest_key;
+    index->key_bits = bit_width(uint64_t(int64_t(highest_key) - lowest_key));
+    index->value_base = lowest;
+    index->value_bits = bit_width(uint64_t(int64_t(highest) - lowest));
+
+    index->pilots.assign((buckets * index->pilot_bits + 63) / 64 + 1, 0);
+    for (size_t b = 0; b < buckets; b++) {
+        write_bits(index->pilots, b * index->pilot_bits, index->pilot_bits, pilots[b]);
+    }
+    index->remap.assign(((table_size - n) * index->remap_bits + 63) / 64 + 1, 0);
+    for (size_t k = 0; k < remap.size(); k++) {
+        write_bits(index->remap, k * index->remap_bits, index->remap_bits, remap[k]);
+    }
+    index->keys.assign((n * index->key_bits + 63) / 64 + 1, 0);
+    index->values.assign((n * index->value_bits + 63) / 64 + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        write_bits(index->keys, slots[i] * index->key_bits, index->key_bits,
+                   uint64_t(int64_t(entries[i].first) - index->key_base));
+        write_bits(index->values, slots[i] * index->value_bits, index->value_bits,
+                   uint64_t(int64_t(entries[i].second) - index->value_base));
+    }
+    return index;
+}
+
+FrequencySketch::FrequencySketch(size_t capacity) : width(16), additions(0), sample(10 * capacity) {
+    while (width < capacity) {
+        width *= 2;
+    }
+    counters.assign(4 * width, 0);
+}
+
+size_t FrequencySketch::slot(int key, int row) const {
+    return row * width + (mix64(static_cast<uint32_t>(key) + row * 0x9e3779b97f4a7c15ull) & (width - 1));
+}
+
+void FrequencySketch::increment(int key) {
+    for (int row = 0; row < 4; row++) {
+        uint8_t& count = counters[slot(key, row)];
+        if (count < 15) {
+            count++;
+        }
+    }
+    if (++additions >= sample) {
+        for (uint8_t& count : counters) {
+            count /= 2;
+        }
+        additions /= 2;
+    }
+}
+
+int FrequencySketch::estimate(int key) const {
+    int lowest = 15;
+    for (int row = 0; row < 4; row++) {
+        lowest = std::min(lowest, static_cast<int>(counters[slot(key, row)]));
+    }
+    return lowest;
+}
+
+CacheKeyStore::CacheKeyStore(size_t capacity, int window_percent)
+    : window_capacity(std::max<size_t>(1, capacity * window_percent / 100)),
+      main_capacity(capacity - std::min(capacity, window_capacity)),
+      protected_capacity(main_capacity * CACHE_PROTECTED_PERCENT / 100),
+      sketch(capacity),
+      evicted(0) {}
+
+CacheKeyStore::Lru& CacheKeyStore::lru(Segment segment) const {
+    return segment == WINDOW ? window_lru : segment == PROBATION ? probation_lru : protected_lru;
+}
+
+bool CacheKeyStore::get(int key, int& value) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    sketch.increment(key);
+    auto found = index.find(key);
+    if (found == index.end()) {
+        return false;
+    }
+    value = found->second->value;
+    touch(found->second);
+    return true;
+}
+
+void CacheKeyStore::put(int key, int value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sketch.increment(key);
+    auto found = index.find(key);
+    if (found != index.end()) {
+        found->second->value = value;
+        touch(found->second);
+        return;
+    }
+    window_lru.push_front({key, value, WINDOW});
+    index[key] = window_lru.begin();
+    if (window_lru.size() > window_capacity) {
+        evict_window();
+    }
+}
+
+bool CacheKeyStore::erase(int key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if (found == index.end()) {
+        return false;
+    }
+    lru(found->second->segment).erase(found->second);
+    index.erase(found);
+    return true;
+}
+
+size_t CacheKeyStore::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return index.size();
+}
+
+KeyList CacheKeyStore::items() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    KeyList entries;
+    for (const Lru* segment : {&window_lru, &probation_lru, &protected_lru}) {
+        for (const Entry& entry : *segment) {
+            entries.push_back({entry.key, entry.value});
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+void CacheKeyStore::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    window_lru.clear();
+    probation_lru.clear();
+    protected_lru.clear();
+    index.clear();
+}
+
+uint64_t CacheKeyStore::evictions() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return evicted;
+}
+
+void CacheKeyStore::touch(Lru::iterator it) const {
+    if (it->segment != PROBATION) {
+        Lru& segment = lru(it->segment);
+        segment.splice(segment.begin(), segment, it);
+        return;
+    }
+    protected_lru.splice(protected_lru.begin(), probation_lru, it);
+    it->segment = PROTECTED;
+    if (protected_lru.size() > protected_capacity) {
+        auto demoted = std::prev(protected_lru.end());
+        probation_lru.splice(probation_lru.begin(), protected_lru, demoted);
+        demoted->segment = PROBATION;
+    }
+}
+
+void CacheKeyStore::drop(Lru::iterator it) {
+    index.erase(it->key);
+    lru(it->segment).erase(it);
+    evicted++;
+}
+
+void CacheKeyStore::evict_window() {
+    auto candidate = std::prev(window_lru.end());
+    if (probation_lru.size() + protected_lru.size() < main_capacity) {
+        probation_lru.splice(probation_lru.begin(), window_lru, candidate);
+        candidate->segment = PROBATION;
+        return;
+    }
+    if (probation_lru.empty()) {
+        drop(candidate);
+        return;
+    }
+    auto victim = std::prev(probation_lru.end());
+    if (sketch.estimate(candidate->key) > sketch.estimate(victim->key)) {
+        drop(victim);
+        probation_lru.splice(probation_lru.begin(), window_lru, candidate);
+        candidate->segment = PROBATION;
+    } else {
+        drop(candidate);
+    }
+}
+
+ColdRun::Writer::Writer() : fd(-1), count(0), failed(false) {
+    static std::atomic<uint64_t> sequence(0);
+    path = TIER_DIRECTORY + "/dht-tier-" + std::to_string(getpid()) + "-" +
+           std::to_string(sequence++) + ".run";
+}
+
+ColdRun::Writer::~Writer() {
+    if (fd >= 0) {
+        close(fd);
+        unlink(path.c_str());
+    }
+}
+
+void ColdRun::Writer::add(int key, int value) {
+    if (fd < 0 && !failed) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        failed = fd < 0;
+    }
+    buffer.push_back({key, value});
+    count++;
+    if (buffer.size() == 4096) {
+        flush();
+    }
+}
+
+void ColdRun::Writer::flush() {
+    const char* data = reinterpret_cast<const char*>(buffer.data());
+    size_t remaining = buffer.size() * sizeof(Record);
+    while (!failed && remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            failed = true;
+            break;
+        }
+        data += written;
+        remaining -= static_cast<size_t>(written);
+    }
+    buffer.clear();
+}
+
+ColdRun* ColdRun::Writer::finish() {
+    if (count == 0) {
+        return nullptr;
+    }
+    flush();
+    size_t bytes = count * sizeof(Record);
+    void* mapped = failed ? MAP_FAILED : mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Cannot write cold run " << path << std::endl;
+        failed = true;
+        unlink(path.c_str());
+        return nullptr;
+    }
+    return new ColdRun(path, static_cast<const Record*>(mapped), count);
+}
+
+ColdRun::ColdRun(const std::string& file, const Record* mapped, size_t entries)
+    : path(file), records(mapped), count(entries) {}
+
+ColdRun::~ColdRun() {
+    munmap(const_cast<Record*>(records), count * sizeof(Record));
+    unlink(path.c_str());
+}
+
+ColdRun* ColdRun::create(const KeyList& entries) {
+    Writer writer;
+    for (auto& kv : entries) {
+        writer.add(kv.first, kv.second);
+    }
+    return writer.finish();
+}
+
+std::vector<ColdRun*> ColdRun::merge(const std::vector<ColdRun*>& inputs, const KeySet& tombstones,
+                                     bool& ok) {
+    // Smallest key first; for equal keys the newest run comes out first.
+    typedef std::pair<int, size_t> Head;
+    auto after = [](const Head& x, const Head& y) {
+        return x.first != y.first ? x.first > y.first : x.second < y.second;
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(after)> heads(after);
+    std::vector<size_t> cursor(inputs.size(), 0);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        heads.push({inputs[i]->records[0].key, i});
+    }
+    std::vector<ColdRun*> outputs;
+    ok = true;
+    Writer* writer = new Writer();
+    bool started = false;
+    int previous = 0;
+    while (!heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+        ColdRun* run = inputs[head.second];
+        if ((!started || head.first != previous) && !tombstones.count(head.first)) {
+            writer->add(head.first, run->records[cursor[head.second]].value);
+            if (writer->size() == TIER_RUN_KEYS) {
+                outputs.push_back(writer->finish());
+                ok = ok && writer->ok();
+                delete writer;
+                writer = new Writer();
+            }
+        }
+        started = true;
+        previous = head.first;
+        if (++cursor[head.second] < run->count) {
+            heads.push({run->records[cursor[head.second]].key, head.second});
+        }
+    }
+    ColdRun* last = writer->finish();
+    ok = ok && writer->ok();
+    delete writer;
+    if (last) {
+        outputs.push_back(last);
+    }
+    if (!ok) {
+        for (ColdRun* output : outputs) {
+            delete output;
+        }
+        outputs.clear();
+    }
+    return outputs;
+}
+
+bool ColdRun::get(int key, int& value) const {
+    const Record* end = records + count;
+    const Record* found = std::lower_bound(records, end, key, [](const Record& record, int k) {
+        return record.key < k;
+    });
+    if (found == end || found->key != key) {
+        return false;
+    }
+    value = found->value;
+    return true;
+}
+
+bool ColdRun::intersects(int a, int b) const {
+    if (a >= b) {
+        return a == b || last_key() > a || first_key() <= b;
+    }
+    const Record* end = records + count;
+    const Record* above = std::upper_bound(records, end, a, [](int k, const Record& record) {
+        return k < record.key;
+    });
+    return above != end && above->key <= b;
+}
+
+KeyList ColdRun::items() const {
+    KeyList entries;
+    entries.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        entries.push_back({records[i].key, records[i].value});
+    }
+    return entries;
+}
+
+// How much of a sorted key span [first, last] lies in (a, b]: 0 none,
+// 2 all, 1 some or none.
+int span_overlap(int first, int last, int a, int b) {
+    if (a == b) {
+        return 2;
+    }
+    if (a < b) {
+        if (first > a && last <= b) {
+            return 2;
+        }
+        return last <= a || first > b ? 0 : 1;
+    }
+    if (first > b && last <= a) {
+        return 0;
+    }
+    return last <= b || first > a ? 2 : 1;
+}
+
+TierDemoter::~TierDemoter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void TierDemoter::schedule(TieredKeyStore* store) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!worker.joinable()) {
+        worker = std::thread(&TierDemoter::run, this);
+    }
+    queue.push_back(store);
+    wake.notify_one();
+}
+
+void TierDemoter::cancel(TieredKeyStore* store) {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return current != store; });
+    queue.erase(std::remove(queue.begin(), queue.end(), store), queue.end());
+}
+
+void TierDemoter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&]() { return stopping || !queue.empty(); });
+        if (stopping) {
+            return;
+        }
+        current = queue.front();
+        queue.pop_front();
+        lock.unlock();
+        current->work();
+        lock.lock();
+        current = nullptr;
+        done.notify_all();
+    }
+}
+
+TieredKeyStore::TieredKeyStore()
+    : clock(0), live(0), busy(false), queued(false), spill_failed(false),
+      promoted(0), handed_over(0) {}
+
+TieredKeyStore::~TieredKeyStore() {
+    TIER_DEMOTER.cancel(this);
+    for (ColdRun* run : fresh) {
+        delete run;
+    }
+    for (ColdRun* run : sorted) {
+        delete run;
+    }
+}
+
+bool TieredKeyStore::get(int key, int& value) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = hot.find(key);
+    if (found != hot.end()) {
+        found->second.touched = ++clock;
+        value = found->second.value;
+        return true;
+    }
+    if (!cold_get(key, value)) {
+        return false;
+    }
+    hot[key] = {value, ++clock};
+    promoted++;
+    if (hot.size() > TIER_HOT_CAPACITY) {
+        request_work();
+    }
+    return true;
+}
+
+void TieredKeyStore::put(int key, int value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int old;
+    if (hot.find(key) == hot.end() && !cold_get(key, old)) {
+        live++;
+    }
+    removed.erase(key);
+    hot[key] = {value, ++clock};
+    if (hot.size() > TIER_HOT_CAPACITY) {
+        request_work();
+    }
+}
+
+bool TieredKeyStore::erase(int key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int old;
+    bool in_hot = hot.erase(key) > 0;
+    bool in_cold = cold_get(key, old);
+    if (in_cold) {
+        removed.insert(key);
+    }
+    if (!in_hot && !in_cold) {
+        return false;
+    }
+    live--;
+    return true;
+}
+
+size_t TieredKeyStore::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return live;
+}
+
+KeyList TieredKeyStore::items() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return merged_items();
+}
+
+void TieredKeyStore::clear() {
+    std::unique_lock<std::mutex> lock(mutex);
+    wait_idle(lock);
+    for (ColdRun* run : fresh) {
+        delete run;
+    }
+    for (ColdRun* run : sorted) {
+        delete run;
+    }
+    fresh.clear();
+    sorted.clear();
+    hot.clear();
+    removed.clear();
+    live = 0;
+}
+
+// Runs only change hands when the target holds nothing in (a, b], which is
+// always the case for ring handoffs. Straddling runs are split before
+// anything moves, so a failed write can still fall back to moving the keys
+// one by one.
+size_t TieredKeyStore::move_range(KeyStore* target, int a, int b, std::vector<int>* moved) {
+    TieredKeyStore* other = dynamic_cast<TieredKeyStore*>(target);
+    if (!other || other == this) {
+        return KeyStore::move_range(target, a, b, moved);
+    }
+    bool this_first = std::less<TieredKeyStore*>()(this, other);
+    TieredKeyStore* first = this_first ? this : other;
+    TieredKeyStore* second = this_first ? other : this;
+    std::unique_lock<std::mutex> first_lock(first->mutex);
+    first->wait_idle(first_lock);
+    std::unique_lock<std::mutex> second_lock(second->mutex);
+    second->wait_idle(second_lock);
+    if (other->intersects(a, b)) {
+        second_lock.unlock();
+        first_lock.unlock();
+        return KeyStore::move_range(target, a, b, moved);
+    }
+
+    std::vector<ColdRun*>* tiers[2] = {&fresh, &sorted};
+    std::vector<ColdRun*>* other_tiers[2] = {&other->fresh, &other->sorted};
+    std::vector<std::pair<ColdRun*, ColdRun*>> splits[2];
+    bool written = true;
+    for (int tier = 0; tier < 2; tier++) {
+        for (ColdRun* run : *tiers[tier]) {
+            splits[tier].push_back({nullptr, nullptr});
+            if (span_overlap(run->first_key(), run->last_key(), a, b) != 1) {
+                continue;
+            }
+            ColdRun::Writer inside;
+            ColdRun::Writer outside;
+            for (size_t r = 0; r < run->size(); r++) {
+                const ColdRun::Record& record = run->at(r);
+                (in_interval(record.key, a, b, true) ? inside : outside).add(record.key, record.value);
+            }
+            splits[tier].back() = {inside.finish(), outside.finish()};
+            written = written && inside.ok() && outside.ok();
+        }
+    }
+    if (!written) {
+        for (auto& tier : splits) {
+            for (auto& split : tier) {
+                delete split.first;
+                delete split.second;
+            }
+        }
+        second_lock.unlock();
+        first_lock.unlock();
+        return KeyStore::move_range(target, a, b, moved);
+    }
+
+    // Sorted runs never share a key, so they are counted by size; keys from
+    // fresh runs and hot are counted once unless a sorted run holds them.
+    std::vector<ColdRun*> given_runs[2];
+    for (int tier = 0; tier < 2; tier++) {
+        std::vector<ColdRun*> kept;
+        for (size_t i = 0; i < tiers[tier]->size(); i++) {
+            ColdRun* run = (*tiers[tier])[i];
+            int overlap = span_overlap(run->first_key(), run->last_key(), a, b);
+            ColdRun* given = overlap == 2 ? run : splits[tier][i].first;
+            if (overlap == 0) {
+                kept.push_back(run);
+            } else if (overlap == 1) {
+                if (splits[tier][i].second) {
+                    kept.push_back(splits[tier][i].second);
+                }
+                delete run;
+            }
+            if (given) {
+                given_runs[tier].push_back(given);
+                other_tiers[tier]->push_back(given);
+                handed_over++;
+            }
+        }
+        *tiers[tier] = kept;
+    }
+    auto in_sorted = [&](int key) {
+        int value;
+        for (ColdRun* run : given_runs[1]) {
+            if (run->first_key() <= key && key <= run->last_key() && run->get(key, value)) {
+                return true;
+            }
+        }
+        return false;
+    };
+    size_t count = 0;
+    for (ColdRun* run : given_runs[1]) {
+        count += run->size();
+    }
+    KeySet extra;
+    for (ColdRun* run : given_runs[0]) {
+        for (size_t r = 0; r < run->size(); r++) {
+            if (!in_sorted(run->at(r).key)) {
+                extra.insert(run->at(r).key);
+            }
+        }
+    }
+    for (auto it = hot.begin(); it != hot.end();) {
+        if (in_interval(it->first, a, b, true)) {
+            other->hot[it->first] = {it->second.value, ++other->clock};
+            if (!in_sorted(it->first)) {
+                extra.insert(it->first);
+            }
+            it = hot.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    KeySet dropped;
+    for (auto it = removed.begin(); it != removed.end();) {
+        if (in_interval(*it, a, b, true)) {
+            other->removed.insert(*it);
+            dropped.insert(*it);
+            it = removed.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    count += extra.size() - dropped.size();
+    live -= count;
+    other->live += count;
+    if (moved) {
+        KeySet keys(extra);
+        for (ColdRun* run : given_runs[1]) {
+            for (size_t r = 0; r < run->size(); r++) {
+                keys.insert(run->at(r).key);
+            }
+        }
+        for (int key : dropped) {
+            keys.erase(key);
+        }
+        moved->insert(moved->end(), keys.begin(), keys.end());
+    }
+    if (other->needs_work()) {
+        other->request_work();
+    }
+    return count;
+}
+
+void TieredKeyStore::wait_for_demotion() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (needs_work()) {
+        request_work();
+    }
+    idle.wait(lock, [&]() { return !busy && !needs_work(); });
+}
+
+size_t TieredKeyStore::hot_size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hot.size();
+}
+
+size_t TieredKeyStore::cold_runs() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return fresh.size() + sorted.size();
+}
+
+bool TieredKeyStore::cold_get(int key, int& value) const {
+    if (removed.count(key)) {
+        return false;
+    }
+    for (auto it = fresh.rbegin(); it != fresh.rend(); ++it) {
+        if ((*it)->get(key, value)) {
+            return true;
+        }
+    }
+    for (ColdRun* run : sorted) {
+        if (run->first_key() <= key && key <= run->last_key() && run->get(key, value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+KeyList TieredKeyStore::merged_items() const {
+    std::map<int,int> merged;
+    for (const std::vector<ColdRun*>* tier : {&sorted, &fresh}) {
+        for (ColdRun* run : *tier) {
+            for (size_t r = 0; r < run->size(); r++) {
+                merged[run->at(r).key] = run->at(r).value;
+            }
+        }
+    }
+    for (int key : removed) {
+        merged.erase(key);
+    }
+    for (auto& kv : hot) {
+        merged[kv.first] = kv.second.value;
+    }
+    return KeyList(merged.begin(), merged.end());
+}
+
+// Whether anything, live or tombstoned, is held for a key in (a, b].
+bool TieredKeyStore::intersects(int a, int b) const {
+    for (const std::vector<ColdRun*>* tier : {&fresh, &sorted}) {
+        for (ColdRun* run : *tier) {
+            if (run->intersects(a, b)) {
+                return true;
+            }
+        }
+    }
+    for (auto& kv : hot) {
+        if (in_interval(kv.first, a, b, true)) {
+            return true;
+        }
+    }
+    for (int key : removed) {
+        if (in_interval(key, a, b, true)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TieredKeyStore::needs_work() const {
+    return !spill_failed && (hot.size() > TIER_HOT_CAPACITY || fresh.size() > TIER_MAX_RUNS);
+}
+
+void TieredKeyStore::wait_idle(std::unique_lock<std::mutex>& lock) const {
+    idle.wait(lock, [&]() { return !busy; });
+}
+
+// Called with the lock held; `queued` keeps a store in TIER_DEMOTER's
+// queue at most once.
+void TieredKeyStore::request_work() const {
+    if (!queued) {
+        queued = true;
+        TIER_DEMOTER.schedule(const_cast<TieredKeyStore*>(this));
+    }
+}
+
+// One demotion or compaction step on TIER_DEMOTER's thread. Files are
+// written with the lock released; `busy` keeps moves and clears out until
+// the result is installed.
+void TieredKeyStore::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    queued = false;
+    if (!needs_work()) {
+        return;
+    }
+    busy = true;
+    if (fresh.size() > TIER_MAX_RUNS) {
+        compact(lock);
+    } else {
+        demote(lock);
+    }
+    busy = false;
+    idle.notify_all();
+    if (needs_work()) {
+        request_work();
+    }
+}
+
+// Demotes the least recently used entries down to half the hot capacity,
+// so a node at its limit does not write a tiny run per insert. Entries
+// touched while the run was written stay hot and shadow their cold copy;
+// entries erased meanwhile get a tombstone.
+void TieredKeyStore::demote(std::unique_lock<std::mutex>& lock) {
+    size_t excess = hot.size() - TIER_HOT_CAPACITY / 2;
+    std::vector<std::pair<uint64_t, int>> ages;
+    ages.reserve(hot.size());
+    for (auto& kv : hot) {
+        ages.push_back({kv.second.touched, kv.first});
+    }
+    std::nth_element(ages.begin(), ages.begin() + excess, ages.end());
+    ages.resize(excess);
+    std::sort(ages.begin(), ages.end(), [](const std::pair<uint64_t, int>& x,
+                                           const std::pair<uint64_t, int>& y) {
+        return x.second < y.second;
+    });
+    KeyList victims;
+    for (auto& age : ages) {
+        victims.push_back({age.second, hot[age.second].value});
+    }
+
+    lock.unlock();
+    ColdRun* run = ColdRun::create(victims);
+    lock.lock();
+    if (!run) {
+        spill_failed = true;
+        return;
+    }
+    fresh.push_back(run);
+    for (auto& age : ages) {
+        auto it = hot.find(age.second);
+        if (it == hot.end()) {
+            removed.insert(age.second);
+        } else if (it->second.touched == age.first) {
+            hot.erase(it);
+        }
+    }
+}
+
+// Merges every run into new sorted runs. Only the demoter adds runs and
+// moves wait for `busy`, so the run lists are unchanged at install time.
+void TieredKeyStore::compact(std::unique_lock<std::mutex>& lock) {
+    std::vector<ColdRun*> inputs = sorted;
+    inputs.insert(inputs.end(), fresh.begin(), fresh.end());
+    KeySet tombstones = removed;
+    lock.unlock();
+    bool ok = true;
+    std::vector<ColdRun*> merged = ColdRun::merge(inputs, tombstones, ok);
+    lock.lock();
+    if (!ok) {
+        spill_failed = true;
+        return;
+    }
+    for (ColdRun* input : inputs) {
+        delete input;
+    }
+    fresh.clear();
+    sorted = merged;
+    for (int key : tombstones) {
+        removed.erase(key);
+    }
+}
+
+ConcurrentKeyStore::Table::Table(size_t capacity)
+    : capacity(capacity), ctrl(new std::atomic<uint64_t>[capacity / 8]),
+      keys(new std::atomic<int>[capacity]), values(new std::atomic<int>[capacity]),
+      used(0), migrate_cursor(0) {
+    memory_allocated(MEM_KEYS, table_bytes(capacity));
+    for (size_t i = 0; i < capacity / 8; i++) {
+        ctrl[i].store(0x8080808080808080ull, std::memory_order_relaxed);
+    }
+}
+
+ConcurrentKeyStore::Table::~Table() {
+    memory_freed(MEM_KEYS, table_bytes(capacity));
+    delete[] ctrl;
+    delete[] keys;
+    delete[] values;
+}
+
+size_t ConcurrentKeyStore::Table::table_bytes(size_t capacity) {
+    return sizeof(Table) + capacity / 8 * sizeof(std::atomic<uint64_t>) +
+           2 * capacity * sizeof(std::atomic<int>);
+}
+
+ConcurrentKeyStore::ConcurrentKeyStore()
+    : current(new Table(KEY_STORE_MIN_CAPACITY)), next(nullptr), live(0) {}
+
+ConcurrentKeyStore::~ConcurrentKeyStore() {
+    delete current.load();
+    delete next.load();
+}
+
+uint64_t ConcurrentKeyStore::hash(int key) {
+    uint64_t h = static_cast<uint32_t>(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint8_t ConcurrentKeyStore::ctrl_byte(const Table* table, size_t slot) {
+    uint64_t word = table->ctrl[slot / 8].load(std::memory_order_acquire);
+    return static_cast<uint8_t>(word >> ((slot % 8) * 8));
+}
+
+bool ConcurrentKeyStore::set_ctrl(Table* table, size_t slot, uint8_t expected, uint8_t desired) {
+    std::atomic<uint64_t>& word = table->ctrl[slot / 8];
+    int shift = static_cast<int>(slot % 8) * 8;
+    uint64_t old_word = word.load(std::memory_order_acquire);
+    while (true) {
+        if (static_cast<uint8_t>(old_word >> shift) != expected) {
+            return false;
+        }
+        uint64_t new_word = (old_word & ~(0xFFull << shift)) |
+                            (static_cast<uint64_t>(desired) << shift);
+        if (word.compare_exchange_weak(old_word, new_word, std::memory_order_acq_rel)) {
+            return true;
+        }
+    }
+}
+
+// Bit i of the result is set when slot group * 16 + i carries `tag`.
+unsigned ConcurrentKeyStore::match_group(const Table* table, size_t group, uint8_t tag) {
+    uint64_t lo = table->ctrl[group * 2].load(std::memory_order_acquire);
+    uint64_t hi = table->ctrl[group * 2 + 1].load(std::memory_order_acquire);
+#if defined(__SSE2__)
+    __m128i tags = _mm_set_epi64x(static_cast<long long>(hi), static_cast<long long>(lo));
+    __m128i hits = _mm_cmpeq_epi8(tags, _mm_set1_epi8(static_cast<char>(tag)));
+    return static_cast<unsigned>(_mm_movemask_epi8(hits));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < 8; i++) {
+        if (static_cast<uint8_t>(lo >> (i * 8)) == tag) {
+            mask |= 1u << i;
+        }
+        if (static_cast<uint8_t>(hi >> (i * 8)) == tag) {
+            mask |= 1u << (i + 8);
+        }
+    }
+    return mask;
+#endif
+}
+
+long ConcurrentKeyStore::find_slot(const Table* table, int key) {
+    uint64_t h = hash(key);
+    uint8_t tag = static_cast<uint8_t>(h & 0x7F);
+    size_t groups = table->capacity / 16;
+    size_t group = (h >> 7) & (groups - 1);
+    for (size_t probe = 0; probe < groups; probe++) {
+        unsigned hits = match_group(table, group, tag);
+        while (hits) {
+            int i = __builtin_ctz(hits);
+            size_t slot = group * 16 + i;
+            if (table->keys[slot].load(std::memory_order_relaxed) == key) {
+                return static_cast<long>(slot);
+            }
+            hits &= hits - 1;
+        }
+        if (match_group(table, group, EMPTY)) {
+            return -1;
+        }
+        group = (group + 1) & (groups - 1);
+    }
+    return -1;
+}
+
+// Takes the first EMPTY slot on the key's probe sequence. The caller holds
+// the key's stripe and has checked the key is absent from `table`.
+bool ConcurrentKeyStore::claim_slot(Table* table, int key, int value) {
+    uint64_t h = hash(key);
+    uint8_t tag = static_cast<uint8_t>(h & 0x7F);
+    size_t groups = table->capacity / 16;
+    size_t group = (h >> 7) & (groups - 1);
+    for (size_t probe = 0; probe < groups; probe++) {
+        unsigned empties = match_group(table, group, EMPTY);
+        while (empties) {
+            size_t slot = group * 16 + __builtin_ctz(empties);
+            if (set_ctrl(table, slot, EMPTY, BUSY)) {
+                table->keys[slot].store(key, std::memory_order_relaxed);
+                table->values[slot].store(value, std::memory_order_relaxed);
+                set_ctrl(table, slot, BUSY, tag);
+                table->used++;
+                return true;
+            }
+            empties = match_group(table, group, EMPTY);
+        }
+        group = (group + 1) & (groups - 1);
+    }
+    return false;
+}
+
+void ConcurrentKeyStore::mark_deleted(Table* table, size_t slot) {
+    set_ctrl(table, slot, ctrl_byte(table, slot), DELETED);
+}
+
+bool ConcurrentKeyStore::get(int key, int& value) const {
+    EpochGuard guard;
+    while (true) {
+        Table* new_table = next.load(std::memory_order_acquire);
+        Table* old_table = current.load(std::memory_order_acquire);
+        bool found = false;
+        int found_value = 0;
+        for (Table* table : {old_table, new_table}) {
+            long slot = table ? find_slot(table, key) : -1;
+            if (slot >= 0) {
+                found_value = table->values[slot].load(std::memory_order_acquire);
+                found = true;
+                break;
+            }
+        }
+        if (next.load(std::memory_order_acquire) == new_table &&
+            current.load(std::memory_order_acquire) == old_table) {
+            if (found) {
+                value = found_value;
+            }
+            return found;
+        }
+    }
+}
+
+void ConcurrentKeyStore::put(int key, int value) {
+    EpochGuard guard;
+    while (true) {
+        help_resize();
+        bool inserted = false;
+        Table* full = nullptr;
+        {
+            std::shared_lock<std::shared_mutex> resizing(resize_mutex);
+            std::lock_guard<std::mutex> lock(stripe_for(key));
+            Table* old_table = current.load();
+            Table* new_table = next.load();
+            Table* target = new_table ? new_table : old_table;
+
+            long slot = find_slot(target, key);
+            if (slot >= 0) {
+                target->values[slot].store(value, std::memory_order_release);
+                return;
+            }
+            if (claim_slot(target, key, value)) {
+                long old_slot = new_table ? find_slot(old_table, key) : -1;
+                if (old_slot >= 0) {
+                    mark_deleted(old_table, old_slot);
+                } else {
+                    live++;
+                }
+                if (target->used * 8 < target->capacity * 7) {
+                    return;
+                }
+                inserted = true;
+            }
+            full = target;
+        }
+        grow(full);
+        if (inserted) {
+            return;
+        }
+    }
+}
+
+bool ConcurrentKeyStore::erase(int key) {
+    EpochGuard guard;
+    help_resize();
+    std::shared_lock<std::shared_mutex> resizing(resize_mutex);
+    std::lock_guard<std::mutex> lock(stripe_for(key));
+    for (Table* table : {current.load(), next.load()}) {
+        long slot = table ? find_slot(table, key) : -1;
+        if (slot >= 0) {
+            mark_deleted(table, slot);
+            live--;
+            return true;
+        }
+    }
+    return false;
+}
+
+KeyList ConcurrentKeyStore::items() const {
+    EpochGuard guard;
+    while (true) {
+        Table* new_table = next.load(std::memory_order_acquire);
+        Table* old_table = current.load(std::memory_order_acquire);
+        std::map<int,int> collected;
+        for (Table* table : {old_table, new_table}) {
+            if (!table) {
+                continue;
+            }
+            for (size_t slot = 0; slot < table->capacity; slot++) {
+                if (ctrl_byte(table, slot) < EMPTY) {
+                    collected.insert({table->keys[slot].load(std::memory_order_relaxed),
+                                      table->values[slot].load(std::memory_order_acquire)});
+                }
+            }
+        }
+        if (next.load(std::memory_order_acquire) == new_table &&
+            current.load(std::memory_order_acquire) == old_table) {
+            return KeyList(collected.begin(), collected.end());
+        }
+    }
+}
+
+void ConcurrentKeyStore::grow(Table* full) {
+    if (full == next.load()) {
+        finish_resize(full);
+    } else {
+        start_resize(full);
+    }
+}
+
+// Installs a table sized for four times the live keys; a table clogged with
+// DELETED slots is rebuilt at the same size.
+void ConcurrentKeyStore::start_resize(Table* full) {
+    std::unique_lock<std::shared_mutex> resizing(resize_mutex);
+    if (current.load() != full || next.load()) {
+        return;
+    }
+    size_t capacity = KEY_STORE_MIN_CAPACITY;
+    while (capacity < live.load() * 4) {
+        capacity *= 2;
+    }
+    capacity = std::max(capacity, full->capacity);
+    next.store(new Table(capacity), std::memory_order_release);
+}
+
+// Moves one chunk of the old table into the new one. Once every chunk has
+// been handed out, the next writer finishes the resize.
+void ConcurrentKeyStore::help_resize() {
+    Table* new_table = nullptr;
+    bool done = false;
+    {
+        std::shared_lock<std::shared_mutex> resizing(resize_mutex);
+        new_table = next.load();
+        if (!new_table) {
+            return;
+        }
+        Table* old_table = current.load();
+        size_t begin = new_table->migrate_cursor.fetch_add(KEY_STORE_MIGRATE_CHUNK);
+        size_t end = std::min(begin + KEY_STORE_MIGRATE_CHUNK, old_table->capacity);
+        for (size_t slot = begin; slot < end && !done; slot++) {
+            if (ctrl_byte(old_table, slot) >= EMPTY) {
+                continue;
+            }
+            int key = old_table->keys[slot].load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(stripe_for(key));
+            if (ctrl_byte(old_table, slot) >= EMPTY) {
+                continue;
+            }
+            if (claim_slot(new_table, key,
+                           old_table->values[slot].load(std::memory_order_acquire))) {
+                mark_deleted(old_table, slot);
+            } else {
+                done = true;
+            }
+        }
+        done = done || end >= old_table->capacity;
+    }
+    if (done) {
+        finish_resize(new_table);
+    }
+}
+
+// With writers excluded, moves whatever is still live in the old table and
+// makes the new table current. If the new table ran out of room in the
+// meantime, both are copied into a fresh table instead.
+void ConcurrentKeyStore::finish_resize(Table* new_table) {
+    std::unique_lock<std::shared_mutex> resizing(resize_mutex);
+    if (next.load() != new_table) {
+        return;
+    }
+    Table* old_table = current.load();
+    bool fits = true;
+    for (size_t slot = 0; slot < old_table->capacity && fits; slot++) {
+        if (ctrl_byte(old_table, slot) < EMPTY) {
+            fits = claim_slot(new_table, old_table->keys[slot].load(),
+                              old_table->values[slot].load());
+            if (fits) {
+                mark_deleted(old_table, slot);
+            }
+        }
+    }
+    if (!fits) {
+        size_t capacity = KEY_STORE_MIN_CAPACITY;
+        while (capacity < live.load() * 4) {
+            capacity *= 2;
+        }
+        Table* fresh = new Table(capacity);
+        for (Table* table : {new_table, old_table}) {
+            for (size_t slot = 0; slot < table->capacity; slot++) {
+                if (ctrl_byte(table, slot) < EMPTY) {
+                    claim_slot(fresh, table->keys[slot].load(), table->values[slot].load());
+                }
+            }
+        }
+        RECLAIMER.retire(new_table);
+        new_table = fresh;
+    }
+    current.store(new_table, std::memory_order_release);
+    next.store(nullptr, std::memory_order_release);
+    RECLAIMER.retire(old_table);
+}
+
+// With `inline_storage` (a Node's inline_keys) a small store is built in
+// place; its bytes are already counted with the node, so MEM_KEYS only sees
+// what it spills.
+KeyStore* make_key_store(void* inline_storage) {
+    if (KEY_STORE_KIND == STORE_CONCURRENT) {
+        return new ConcurrentKeyStore();
+    }
+    if (KEY_STORE_KIND == STORE_SMALL && inline_storage) {
+        KeyStore* store = ::new (inline_storage) SmallKeyStore();
+        memory_freed(MEM_KEYS, sizeof(SmallKeyStore));
+        return store;
+    }
+    if (KEY_STORE_KIND == STORE_SMALL) {
+        return new SmallKeyStore();
+    }
+    if (KEY_STORE_KIND == STORE_ELIAS_FANO) {
+        return new EliasFanoKeyStore();
+    }
+    if (KEY_STORE_KIND == STORE_PERFECT_HASH) {
+        return new PerfectHashKeyStore();
+    }
+    if (KEY_STORE_KIND == STORE_CACHE) {
+        return new CacheKeyStore(CACHE_CAPACITY);
+    }
+    if (KEY_STORE_KIND == STORE_TIERED) {
+        return new TieredKeyStore();
+    }
+    return new MapKeyStore();
+}
+
+WriteAheadLog::WriteAheadLog(const std::string& path, bool sync_writes)
+    : appends(0), records_written(0), failures(0),
+      fd(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644)),
+      sync(sync_writes) {
+    if (fd < 0) {
+        std::cerr << "Cannot open write-ahead log " << path << std::endl;
+    }
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool WriteAheadLog::append(const std::vector<WalRecord>& records) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const char* data = reinterpret_cast<const char*>(records.data());
+    size_t remaining = records.size() * sizeof(WalRecord);
+    bool ok = fd >= 0;
+    while (ok && remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            std::cerr << "Write-ahead log append failed" << std::endl;
+            ok = false;
+            break;
+        }
+        data += written;
+        remaining -= static_cast<size_t>(written);
+    }
+    if (ok && sync) {
+        int synced;
+        while ((synced = fdatasync(fd)) < 0 && errno == EINTR) {
+        }
+        if (synced < 0) {
+            std::cerr << "Write-ahead log sync failed" << std::endl;
+            ok = false;
+        }
+    }
+    if (!ok) {
+        failures++;
+        return false;
+    }
+    appends++;
+    records_written += records.size();
+    return true;
+}
+
+BlobArena::~BlobArena() {
+    for (Blob* blob : slots) {
+        delete blob;
+    }
+}
+
+BlobArena::Blob::~Blob() {
+    if (mapped) {
+        munmap(mapped, mapped_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+int BlobArena::put(const char* data, size_t size) {
+    Blob* blob = new Blob();
+    blob->bytes.assign(data, data + size);
+    return insert(blob);
+}
+
+// Maps the first `size` bytes of `fd` as a blob and takes over the
+// descriptor; on failure the caller keeps it.
+int BlobArena::adopt_file(int fd, size_t size) {
+    void* mapped = nullptr;
+    if (size > 0) {
+        mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            return -1;
+        }
+    }
+    Blob* blob = new Blob();
+    blob->fd = fd;
+    blob->mapped = static_cast<char*>(mapped);
+    blob->mapped_size = size;
+    return insert(blob);
+}
+
+int BlobArena::insert(Blob* blob) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t index;
+    if (!free_slots.empty()) {
+        index = static_cast<size_t>(free_slots.back());
+        free_slots.pop_back();
+    } else if (slots.size() < (size_t(1) << BLOB_SLOT_BITS)) {
+        index = slots.size();
+        slots.push_back(nullptr);
+        generations.push_back(0);
+    } else {
+        std::cerr << "Blob arena is full" << std::endl;
+        delete blob;
+        return -1;
+    }
+    slots[index] = blob;
+    return static_cast<int>(generations[index] << BLOB_SLOT_BITS | index);
+}
+
+// The blob behind a live handle, optionally only if it is bound to `key`.
+// Called with the mutex held.
+BlobArena::Blob* BlobArena::locate(int handle, int key) {
+    if (handle < 0) {
+        return nullptr;
+    }
+    size_t index = static_cast<size_t>(handle) & ((size_t(1) << BLOB_SLOT_BITS) - 1);
+    uint32_t generation = static_cast<uint32_t>(handle) >> BLOB_SLOT_BITS;
+    if (index >= slots.size() || !slots[index] || generations[index] != generation) {
+        return nullptr;
+    }
+    Blob* blob = slots[index];
+    return key == BLOB_ANY_KEY || blob->key == key ? blob : nullptr;
+}
+
+BlobArena::Blob* BlobArena::slot(int handle) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return locate(handle, BLOB_ANY_KEY);
+}
+
+void BlobArena::bind(int handle, int key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (Blob* blob = locate(handle, BLOB_ANY_KEY)) {
+        blob->key = key;
+    }
+}
+
+// Fails once the last reference is gone, so a reader racing an overwrite
+// either pins the old blob or sees it missing.
+bool BlobArena::retain(int handle, int key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Blob* blob = locate(handle, key);
+    if (!blob) {
+        return false;
+    }
+    blob->refs++;
+    return true;
+}
+
+// Freeing a slot advances its generation, which retires every handle to
+// it. Generations wrap after 2^(31 - BLOB_SLOT_BITS) reuses of one slot.
+void BlobArena::release(int handle, int key) {
+    Blob* dead = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Blob* blob = locate(handle, key);
+        if (!blob) {
+            return;
+        }
+        if (--blob->refs == 0) {
+            dead = blob;
+            size_t index = static_cast<size_t>(handle) & ((size_t(1) << BLOB_SLOT_BITS) - 1);
+            slots[index] = nullptr;
+            generations[index] = (generations[index] + 1) & ((1u << (31 - BLOB_SLOT_BITS)) - 1);
+            free_slots.push_back(static_cast<int>(index));
+        }
+    }
+    delete dead;
+}
+
+size_t BlobArena::size(int handle) {
+    Blob* blob = slot(handle);
+    return blob ? blob->length() : 0;
+}
+
+// A view into the blob itself; valid while the caller holds a reference.
+std::pair<const char*, size_t> BlobArena::chunk(int handle, size_t index) {
+    Blob* blob = slot(handle);
+    size_t offset = index * BLOB_CHUNK_SIZE;
+    if (!blob || offset >= blob->length()) {
+        return {nullptr, 0};
+    }
+    return {blob->data() + offset, std::min(BLOB_CHUNK_SIZE, blob->length() - offset)};
+}
+
+// Writes the whole blob to a socket without staging it in a buffer:
+// file-backed blobs go out with sendfile() from the page cache, in-memory
+// ones chunk by chunk from the blob itself. The caller holds a reference.
+bool BlobArena::send(int handle, int socket) {
+    Blob* blob = slot(handle);
+    if (!blob) {
+        return false;
+    }
+    size_t offset = 0;
+    while (offset < blob->length()) {
+        size_t remaining = blob->length() - offset;
+        ssize_t sent;
+        if (blob->fd >= 0) {
+            off_t position = static_cast<off_t>(offset);
+            sent = sendfile(socket, blob->fd, &position, remaining);
+        } else {
+            sent = ::send(socket, blob->data() + offset, std::min(BLOB_CHUNK_SIZE, remaining),
+                          MSG_NOSIGNAL);
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        offset += static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+size_t BlobArena::live_blobs() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return slots.size() - free_slots.size();
+}
+
+bool BlobRef::acquire(int blob_handle, int key) {
+    reset();
+    if (!BLOBS.retain(blob_handle, key)) {
+        return false;
+    }
+    handle = blob_handle;
+    return true;
+}
+
+void BlobRef::reset() {
+    if (handle >= 0) {
+        BLOBS.release(handle);
+        handle = -1;
+    }
+}
+
+char* ChunkPool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (storage.empty()) {
+        storage.resize(buffer_count * BLOB_CHUNK_SIZE);
+        for (size_t i = 0; i < buffer_count; i++) {
+            free_buffers.push_back(storage.data() + i * BLOB_CHUNK_SIZE);
+        }
+    }
+    available.wait(lock, [this]() { return !free_buffers.empty(); });
+    char* buffer = free_buffers.back();
+    free_buffers.pop_back();
+    peak = std::max(peak, ++in_use);
+    return buffer;
+}
+
+void ChunkPool::release(char* buffer) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_buffers.push_back(buffer);
+        in_use--;
+    }
+    available.notify_one();
+}
+
+size_t ChunkPool::peak_in_use() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak;
+}
+
+void ChunkPool::reset_peak() {
+    std::lock_guard<std::mutex> lock(mutex);
+    peak = in_use;
+}
+
+// The file is unlinked at once; the blob's descriptor keeps it alive.
+BlobWriter::BlobWriter() : fd(-1), written(0), failed(false) {
+    static std::atomic<uint64_t> sequence(0);
+    std::string path = TIER_DIRECTORY + "/dht-blob-" + std::to_string(getpid()) + "-" +
+                       std::to_string(sequence++) + ".blob";
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    failed = fd < 0;
+    if (fd >= 0) {
+        unlink(path.c_str());
+    }
+}
+
+BlobWriter::~BlobWriter() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool BlobWriter::append(const char* data, size_t size) {
+    while (!failed && size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count < 0) {
+            failed = true;
+            break;
+        }
+        data += count;
+        size -= static_cast<size_t>(count);
+        written += static_cast<size_t>(count);
+    }
+    return !failed;
+}
+
+// Copies up to `size` bytes from a socket through one pooled chunk and
+// returns how many arrived before the peer stopped sending.
+size_t BlobWriter::append_from(int source, size_t size) {
+    char* buffer = STREAM_BUFFERS.acquire();
+    size_t copied = 0;
+    while (!failed && copied < size) {
+        ssize_t received = recv(source, buffer, std::min(BLOB_CHUNK_SIZE, size - copied), 0);
+        if (received <= 0 || !append(buffer, static_cast<size_t>(received))) {
+            break;
+        }
+        copied += static_cast<size_t>(received);
+    }
+    STREAM_BUFFERS.release(buffer);
+    return copied;
+}
+
+int BlobWriter::finish() {
+    if (failed) {
+        return -1;
+    }
+    int handle = BLOBS.adopt_file(fd, written);
+    if (handle >= 0) {
+        fd = -1;
+    }
+    failed = true;
+    return handle;
+}
+
+static const char* LATENCY_OP_NAMES[OP_COUNT] = {"find_key", "insert_key", "join", "leave"};
+
+int latency_bucket(uint64_t ns) {
+    if (ns < 4) {
+        return static_cast<int>(ns);
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int bucket = 4 * (msb - 1) + static_cast<int>((ns >> (msb - 2)) & 3);
+    return std::min(bucket, LATENCY_BUCKETS - 1);
+}
+
+// Upper bound of a bucket, so reported percentiles never understate.
+uint64_t latency_bucket_limit(int bucket) {
+    if (bucket < 4) {
+        return static_cast<uint64_t>(bucket);
+    }
+    int msb = bucket / 4 + 1;
+    uint64_t sub = static_cast<uint64_t>(bucket % 4);
+    return ((5 + sub) << (msb - 2)) - 1;
+}
+
+long latency_tick(std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now()) {
+    return static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        when.time_since_epoch()).count() / LATENCY_SLOT_MS);
+}
+
+LatencyMonitor::LatencyMonitor() : trigger_fires(0) {
+    memory_allocated(MEM_INSTRUMENTATION, sizeof(*this));
+    for (int op = 0; op < OP_COUNT; op++) {
+        thresholds[op] = 0;
+        for (LatencySlot& slot : slots[op]) {
+            slot.tick = -1;
+            for (std::atomic<uint64_t>& count : slot.counts) {
+                count = 0;
+            }
+        }
+    }
+}
+
+void LatencyMonitor::record(LatencyOp op, uint64_t ns, long tick) {
+    LatencySlot& slot = slots[op][tick % LATENCY_SLOTS];
+    long seen = slot.tick.load(std::memory_order_acquire);
+    bool rotated = false;
+    // Slots only move forward: a recorder delayed past a rotation must not
+    // take the slot back and zero the newer window, so its sample is dropped.
+    while (seen < tick) {
+        if (slot.tick.compare_exchange_weak(seen, tick)) {
+            for (std::atomic<uint64_t>& count : slot.counts) {
+                count.store(0, std::memory_order_relaxed);
+            }
+            rotated = true;
+            break;
+        }
+    }
+    if (!rotated && seen > tick) {
+        return;
+    }
+    slot.counts[latency_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t threshold = thresholds[op].load(std::memory_order_relaxed);
+    if (rotated && threshold > 0) {
+        LatencySnapshot snapshot = query(op);
+        if (snapshot.p99_ns > threshold) {
+            trigger_fires++;
+            dump(op, snapshot);
+        }
+    }
+}
+
+LatencySnapshot LatencyMonitor::query(LatencyOp op) {
+    long now = latency_tick();
+    uint64_t counts[LATENCY_BUCKETS] = {};
+    uint64_t total = 0;
+    for (LatencySlot& slot : slots[op]) {
+        long tick = slot.tick.load(std::memory_order_acquire);
+        if (tick < 0 || now - tick >= LATENCY_SLOTS) {
+            continue;
+        }
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            uint64_t count = slot.counts[b].load(std::memory_order_relaxed);
+            counts[b] += count;
+            total += count;
+        }
+    }
+
+    LatencySnapshot snapshot = {total, 0, 0, 0};
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS && total > 0; b++) {
+        seen += counts[b];
+        if (!snapshot.p50_ns && seen * 2 >= total) {
+            snapshot.p50_ns = latency_bucket_limit(b);
+        }
+        if (!snapshot.p99_ns && seen * 100 >= total * 99) {
+            snapshot.p99_ns = latency_bucket_limit(b);
+        }
+        if (!snapshot.p999_ns && seen * 1000 >= total * 999) {
+            snapshot.p999_ns = latency_bucket_limit(b);
+        }
+    }
+    return snapshot;
+}
+
+void LatencyMonitor::set_trigger(LatencyOp op, uint64_t p99_threshold_ns) {
+    thresholds[op] = p99_threshold_ns;
+}
+
+// Only valid while nothing records.
+void LatencyMonitor::reset() {
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (LatencySlot& slot : slots[op]) {
+            slot.tick = -1;
+        }
+    }
+    trigger_fires = 0;
+}
+
+void LatencyMonitor::dump(LatencyOp op, const LatencySnapshot& snapshot) {
+    std::ostringstream trace;
+    trace << "SLO trigger: " << LATENCY_OP_NAMES[op] << " p99 " << snapshot.p99_ns
+          << " ns over " << snapshot.count << " ops (p50 " << snapshot.p50_ns
+          << " ns, p999 " << snapshot.p999_ns << " ns)" << std::endl;
+    long now = latency_tick();
+    for (const LatencySlot& slot : slots[op]) {
+        long tick = slot.tick.load();
+        if (tick < 0 || now - tick >= LATENCY_SLOTS) {
+            continue;
+        }
+        trace << "  slot -" << (now - tick) * LATENCY_SLOT_MS << " ms:";
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            uint64_t count = slot.counts[b].load(std::memory_order_relaxed);
+            if (count) {
+                trace << " <=" << latency_bucket_limit(b) << "ns:" << count;
+            }
+        }
+        trace << std::endl;
+    }
+    std::cerr << trace.str();
+}
+
+LatencyTimer::LatencyTimer(LatencyOp timed_op) : op(timed_op), active(MONITOR_LATENCY) {
+    if (active) {
+        start = std::chrono::steady_clock::now();
+    }
+}
+
+LatencyTimer::~LatencyTimer() {
+    if (active) {
+        auto end = std::chrono::steady_clock::now();
+        LATENCY.record(op, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - start).count()), latency_tick(end));
+    }
+}
+
+static std::atomic<int> NEXT_METRIC_STRIPE(0);
+
+StripedCounter::StripedCounter() {
+    for (CounterStripe& stripe : stripes) {
+        stripe.value = 0;
+    }
+}
+
+void StripedCounter::add(uint64_t n) {
+    thread_local int stripe = NEXT_METRIC_STRIPE++ % METRIC_STRIPES;
+    stripes[stripe].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t StripedCounter::load() const {
+    uint64_t total = 0;
+    for (const CounterStripe& stripe : stripes) {
+        total += stripe.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+RingMetrics::RingMetrics() {
+    memory_allocated(MEM_INSTRUMENTATION, sizeof(*this));
+}
+
+void memory_allocated(MemoryTag tag, size_t bytes) {
+    MEMORY[tag].allocated_bytes.add(bytes);
+    MEMORY[tag].allocations.add();
+}
+
+void memory_freed(MemoryTag tag, size_t bytes) {
+    MEMORY[tag].freed_bytes.add(bytes);
+}
+
+MemoryUsage memory_usage(MemoryTag tag) {
+    uint64_t allocated = MEMORY[tag].allocated_bytes.load();
+    return {allocated - MEMORY[tag].freed_bytes.load(), allocated,
+            MEMORY[tag].allocations.load()};
+}
+
+void record_migration(size_t key_count) {
+    METRICS.migrated_keys.add(key_count);
+    METRICS.migration_bytes.add(key_count * 2 * sizeof(int));
+}
+
+// Takes no locks: counters are summed, the member list is the published
+// MEMBERS copy read under an EpochGuard, and per-node key counts are the
+// nodes' key_count mirrors, never the stores themselves.
+std::string render_metrics() {
+    EpochGuard guard;
+    const RoutingList& members = MEMBERS.load(std::memory_order_acquire)->nodes;
+    std::vector<Node*> nodes(members.begin(), members.end());
+    std::sort(nodes.begin(), nodes.end(), [](Node* a, Node* b){ return a->id < b->id; });
+
+    std::ostringstream out;
+    auto header = [&](const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " " << type << "\n";
+    };
+    auto counter = [&](const char* name, const char* help, uint64_t value) {
+        header(name, "counter", help);
+        out << name << " " << value << "\n";
+    };
+    counter("dht_lookups_total", "Lookups routed with Node::find_key.",
+            METRICS.lookups.load());
+    counter("dht_lookup_hops_total", "Hops taken by those lookups.",
+            METRICS.lookup_hops.load());
+    counter("dht_writes_total", "insert_key and remove_key calls.",
+            METRICS.writes.load());
+    counter("dht_fenced_writes_total", "Writes rejected by a stale ownership epoch.",
+            static_cast<uint64_t>(FENCED_WRITES.load()));
+    counter("dht_backpressure_signals_total", "Writes rejected by a full owner inbox.",
+            static_cast<uint64_t>(BACKPRESSURE_SIGNALS.load()));
+    counter("dht_shed_writes_total", "Writes given up after WRITE_MAX_REJECTIONS rejections.",
+            static_cast<uint64_t>(SHED_WRITES.load()));
+    counter("dht_migrated_keys_total", "Keys handed over on joins and leaves.",
+            METRICS.migrated_keys.load());
+    counter("dht_migration_bytes_total", "Key and value bytes handed over on joins and leaves.",
+            METRICS.migration_bytes.load());
+    counter("dht_finger_rebuilds_total", "Finger table rebuilds.",
+            METRICS.finger_rebuilds.load());
+    counter("dht_reclaimed_objects_total", "Objects freed by epoch-based reclamation.",
+            RECLAIMER.reclaimed_total.load());
+
+    header("dht_memory_live_bytes", "gauge", "Live bytes by subsystem.");
+    for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+        out << "dht_memory_live_bytes{subsystem=\"" << MEMORY_TAG_NAMES[tag] << "\"} "
+            << memory_usage(static_cast<MemoryTag>(tag)).live_bytes << "\n";
+    }
+    header("dht_memory_allocated_bytes_total", "counter", "Bytes allocated by subsystem.");
+    for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+        out << "dht_memory_allocated_bytes_total{subsystem=\"" << MEMORY_TAG_NAMES[tag] << "\"} "
+            << memory_usage(static_cast<MemoryTag>(tag)).allocated_bytes << "\n";
+    }
+    header("dht_nodes", "gauge", "Live ring members.");
+    out << "dht_nodes " << nodes.size() << "\n";
+    header("dht_node_keys", "gauge", "Keys stored per node.");
+    for (Node* node : nodes) {
+        out << "dht_node_keys{node=\"" << node->id << "\"} " << node->key_count.load() << "\n";
+    }
+    header("dht_node_queue_depth", "gauge", "Coalesced writes queued per node.");
+    for (Node* node : nodes) {
+        out << "dht_node_queue_depth{node=\"" << node->id << "\"} "
+            << node->queue_depth.load() << "\n";
+    }
+    return out.str();
+}
+
+MetricsExporter::MetricsExporter() : listen_fd(-1), bound_port(0), running(false) {}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+}
+
+// Accepted connections give up on a peer that stalls this long in one
+// recv or send, so an idle client cannot hang a server thread or stop().
+static const int CLIENT_TIMEOUT_MS = 1000;
+
+void set_client_timeouts(int client) {
+    timeval timeout = {CLIENT_TIMEOUT_MS / 1000, (CLIENT_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Listens on the loopback interface; port 0 picks a free one.
+int listen_loopback(int port, int& bound_port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    socklen_t length = sizeof(address);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), length) < 0 ||
+        listen(fd, 16) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+        close(fd);
+        return -1;
+    }
+    bound_port = ntohs(address.sin_port);
+    return fd;
+}
+
+// Reads up to the blank line ending the request head. Body bytes that
+// arrived with it are left in `body`.
+bool read_request_head(int client, std::string& head, std::string& body) {
+    char buffer[1024];
+    size_t end;
+    while ((end = head.find("\r\n\r\n")) == std::string::npos && head.size() < 8192) {
+        ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            return false;
+        }
+        head.append(buffer, static_cast<size_t>(received));
+    }
+    if (end == std::string::npos) {
+        return false;
+    }
+    body = head.substr(end + 4);
+    head.resize(end + 4);
+    return true;
+}
+
+bool send_all(int socket, const std::string& bytes) {
+    size_t sent = 0;
+    while (sent < bytes.size()) {
+        ssize_t written = send(socket, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool MetricsExporter::start(int port) {
+    listen_fd = listen_loopback(port, bound_port);
+    if (listen_fd < 0) {
+        return false;
+    }
+    running = true;
+    server = std::thread(&MetricsExporter::serve, this);
+    return true;
+}
+
+void MetricsExporter::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    server.join();
+    close(listen_fd);
+    listen_fd = -1;
+}
+
+// One request per connection; polls so stop() is noticed within 100 ms,
+// or CLIENT_TIMEOUT_MS later if a client is stalling.
+void MetricsExporter::serve() {
+    while (running.load()) {
+        pollfd waiting = {listen_fd, POLLIN, 0};
+        if (poll(&waiting, 1, 100) <= 0) {
+            continue;
+        }
+        int client = accept(listen_fd, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        set_client_timeouts(client);
+        std::string request;
+        std::string unused;
+        if (!read_request_head(client, request, unused)) {
+            close(client);
+            continue;
+        }
+
+        std::string status = "404 Not Found";
+        std::string body = "not found\n";
+        std::string type = "text/plain";
+        if (request.compare(0, 13, "GET /metrics ") == 0) {
+            status = "200 OK";
+            body = render_metrics();
+            type = "text/plain; version=0.0.4";
+        }
+        std::ostringstream response;
+        response << "HTTP/1.1 " << status << "\r\n"
+                 << "Content-Type: " << type << "\r\n"
+                 << "Content-Length: " << body.size() << "\r\n"
+                 << "Connection: close\r\n\r\n" << body;
+        send_all(client, response.str());
+        close(client);
+    }
+}
+
+BlobServer::BlobServer(Node* contact_node)
+    : contact(contact_node), listen_fd(-1), bound_port(0), running(false) {}
+
+BlobServer::~BlobServer() {
+    stop();
+}
+
+bool BlobServer::start(int port) {
+    listen_fd = listen_loopback(port, bound_port);
+    if (listen_fd < 0) {
+        return false;
+    }
+    running = true;
+    server = std::thread(&BlobServer::serve, this);
+    return true;
+}
+
+void BlobServer::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    server.join();
+    close(listen_fd);
+    listen_fd = -1;
+}
+
+// sendfile() has no MSG_NOSIGNAL, so a client hanging up mid-value raises
+// SIGPIPE. It is blocked on this thread only, which then sees EPIPE, and
+// any pending one is consumed after each request. Stalled clients time out
+// after CLIENT_TIMEOUT_MS per recv or send.
+void BlobServer::serve() {
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+    while (running.load()) {
+        pollfd waiting = {listen_fd, POLLIN, 0};
+        if (poll(&waiting, 1, 100) <= 0) {
+            continue;
+        }
+        int client = accept(listen_fd, nullptr, nullptr);
+        if (client >= 0) {
+            set_client_timeouts(client);
+            handle(client);
+            close(client);
+            timespec no_wait = {0, 0};
+            sigtimedwait(&pipe_signal, nullptr, &no_wait);
+        }
+    }
+}
+
+// Parses text[begin, end) as a decimal number; false unless it is all
+// digits and below `limit`.
+bool parse_bounded(const std::string& text, size_t begin, size_t end,
+                   uint64_t limit, uint64_t& value) {
+    value = 0;
+    if (end == std::string::npos || begin >= end) {
+        return false;
+    }
+    for (size_t i = begin; i < end; i++) {
+        if (!std::isdigit(static_cast<unsigned char>(text[i])) || value >= limit) {
+            return false;
+        }
+        value = value * 10 + static_cast<uint64_t>(text[i] - '0');
+    }
+    return value < limit;
+}
+
+void BlobServer::handle(int client) {
+    std::string head;
+    std::string body;
+    if (!read_request_head(client, head, body)) {
+        return;
+    }
+    bool get = head.compare(0, 10, "GET /blob/") == 0;
+    bool put = head.compare(0, 10, "PUT /blob/") == 0;
+    const char* status = "404 Not Found";
+    uint64_t parsed_key = 0;
+    if ((get || put) && !parse_bounded(head, 10, head.find(' ', 10), MAX_ID, parsed_key)) {
+        status = "400 Bad Request";
+    } else if (get || put) {
+        int key = static_cast<int>(parsed_key);
+        if (get) {
+            BlobRef value;
+            if (contact->get_blob(key, value)) {
+                send_all(client, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                                 "Content-Length: " + std::to_string(value.size()) +
+                                 "\r\nConnection: close\r\n\r\n");
+                value.send(client);
+                return;
+            }
+        } else {
+            std::string lower = head;
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            size_t field = lower.find("\r\ncontent-length:");
+            size_t digits = field == std::string::npos
+                                ? field : head.find_first_not_of(' ', field + 17);
+            uint64_t length = 0;
+            bool sized = digits != std::string::npos &&
+                         parse_bounded(head, digits, head.find("\r\n", digits),
+                                       uint64_t(1) << 40, length);
+            BlobWriter writer;
+            size_t early = std::min(body.size(), static_cast<size_t>(length));
+            writer.append(body.data(), early);
+            bool complete = sized && writer.append_from(client, length - early) == length - early;
+            status = !complete ? "400 Bad Request"
+                     : contact->insert_blob(key, writer) ? "201 Created"
+                     : "507 Insufficient Storage";
+        }
+    }
+    send_all(client, std::string("HTTP/1.1 ") + status +
+                     "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+}
+
+void Node::print_finger_table() {
+    finger->pretty_print();
+}
+
+FingerTable::~FingerTable() {
+    delete row.load();
+}
+
+void FingerTable::update() {
+    METRICS.finger_rebuilds.add();
+    FingerRow* fresh = new FingerRow();
+    FingerList& fingers = fresh->fingers;
+    for (int i = 0; i < M; i++) {
+        int start = (node->id + (1 << i)) % MAX_ID;
+        Node* target = get_successor_for(start);
+        if (fingers.empty() || fingers.back().target != target) {
+            fingers.push_back({start, target->id, target});
+        }
+    }
+    RECLAIMER.retire(row.exchange(fresh, std::memory_order_acq_rel));
+}
+
+Node* FingerTable::entry(int i) const {
+    int offset = 1 << i;
+    Node* target = nullptr;
+    for (const Finger& f : snapshot()->fingers) {
+        if ((f.start - node->id + MAX_ID) % MAX_ID > offset) {
+            break;
+        }
+        target = f.target;
+    }
+    return target;
+}
+
+void FingerTable::pretty_print() {
+    std::cout << "Finger table of node " << node->id << ":" << std::endl;
+    for (int i = 0; i < M; i++) {
+        int start = (node->id + (1 << i)) % MAX_ID;
+        std::cout << "start " << start << " -> " << entry(i)->id << std::endl;
+    }
+}
+
+KBucketTable::~KBucketTable() {
+    delete row.load();
+}
+
+void KBucketTable::update() {
+    KBucketRow* fresh = new KBucketRow();
+    auto& buckets = fresh->buckets;
+    for (Node* other : DHT_NODES) {
+        int distance = other->id ^ node->id;
+        if (distance == 0) {
+            continue;
+        }
+        int bucket = 0;
+        while ((distance >> (bucket + 1)) != 0) {
+            bucket++;
+        }
+        buckets[bucket].push_back(other);
+    }
+    for (int i = 0; i < M; i++) {
+        std::sort(buckets[i].begin(), buckets[i].end(),
+                  [this](Node* a, Node* b){
+                      return (a->id ^ node->id) < (b->id ^ node->id);
+                  });
+        if (buckets[i].size() > static_cast<size_t>(KADEMLIA_K)) {
+            buckets[i].resize(KADEMLIA_K);
+        }
+    }
+    RECLAIMER.retire(row.exchange(fresh, std::memory_order_acq_rel));
+}
+
+Node* KBucketTable::closest_to(int key) {
+    const KBucketRow* current = snapshot();
+    Node* best = node;
+    for (int i = 0; i < M; i++) {
+        for (Node* contact : current->buckets[i]) {
+            if (contact->alive && (contact->id ^ key) < (best->id ^ key)) {
+                best = contact;
+            }
+        }
+    }
+    return best;
+}
+
+void KBucketTable::pretty_print() {
+    std::cout << "K-buckets of node " << node->id << ":" << std::endl;
+    const KBucketRow* current = snapshot();
+    for (int i = 0; i < M; i++) {
+        std::cout << "bucket " << i << " ->";
+        for (Node* contact : current->buckets[i]) {
+            std::cout << " " << contact->id;
+        }
+        std::cout << std::endl;
+    }
+}
+
+int SymphonyTable::estimate_ring_size() {
+    Node* current = node;
+    int covered = 0;
+    int segments = 0;
+    for (int i = 0; i < SYMPHONY_ESTIMATE_SEGMENTS; i++) {
+        Node* next = get_next_node(current);
+        if (!next || next == node) {
+            break;
+        }
+        covered += (next->id - current->id + MAX_ID) % MAX_ID;
+        segments++;
+        current = next;
+    }
+    if (segments == 0) {
+        return 1;
+    }
+    return std::max(1, segments * MAX_ID / std::max(1, covered));
+}
+
+SymphonyTable::~SymphonyTable() {
+    delete row.load();
+}
+
+void SymphonyTable::update() {
+    SymphonyRow* fresh = new SymphonyRow();
+    Node* successor = fresh->successor = get_next_node(node);
+    int estimated_size = fresh->estimated_size = estimate_ring_size();
+    RoutingList& links = fresh->links;
+
+    std::mt19937 rng(static_cast<unsigned>(node->id) * 2654435761u);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    double n = static_cast<double>(estimated_size);
+    for (int i = 0; i < SYMPHONY_LINKS; i++) {
+        double fraction = std::exp(std::log(n) * (uniform(rng) - 1.0));
+        int distance = std::max(1, static_cast<int>(fraction * MAX_ID));
+        Node* target = get_successor_for((node->id + distance) % MAX_ID);
+        if (target != node && target != successor &&
+            std::find(links.begin(), links.end(), target) == links.end()) {
+            links.push_back(target);
+        }
+    }
+    RECLAIMER.retire(row.exchange(fresh, std::memory_order_acq_rel));
+}
+
+Node* SymphonyTable::closest_preceding_link(const SymphonyRow* current, int key) const {
+    Node* best = node;
+    int best_progress = 0;
+    for (Node* candidate : current->links) {
+        if (candidate->alive && in_interval(candidate->id, node->id, key, false)) {
+            int progress = (candidate->id - node->id + MAX_ID) % MAX_ID;
+            if (progress > best_progress) {
+                best = candidate;
+                best_progress = progress;
+            }
+        }
+    }
+    return best;
+}
+
+void SymphonyTable::pretty_print() {
+    const SymphonyRow* current = snapshot();
+    std::cout << "Symphony links of node " << node->id
+              << " (estimated ring size " << current->estimated_size << "):" << std::endl;
+    std::cout << "successor -> " << current->successor->id << std::endl;
+    for (Node* link : current->links) {
+        std::cout << "long link -> " << link->id << std::endl;
+    }
+}
+
+void set_routing_engine(RoutingEngine* engine) {
+    ROUTING_ENGINE = engine;
+    ROUTING_ENGINE->rebuild();
+}
+
+Node* ChordEngine::owner_of(int key) {
+    return get_successor_for(key);
+}
+
+std::pair<Node*, Path> ChordEngine::find_key(Node* from, int key) {
+    Path path;
+    path.push_back(from->id);
+
+    Node* current = from;
+    while (true) {
+        Node* succ = current->get_successor();
+        if (in_interval(key, current->id, succ->id, true)) {
+            path.push_back(succ->id);
+            return {succ, path};
+        } else {
+            Node* next_node = current->closest_preceding_finger(key);
+            if (next_node == current) {
+                current = current->get_successor();
+                path.push_back(current->id);
+                return {current, path};
+            } else {
+                current = next_node;
+                path.push_back(current->id);
+            }
+        }
+    }
+}
+
+size_t ChordEngine::table_size(Node* node) const {
+    return node->finger->snapshot()->fingers.size();
+}
+
+void ChordEngine::rebuild() {
+    update_all_finger_tables();
+}
+
+bool ChordEngine::owns(Node* node, int key) {
+    return node->alive && in_interval(key, node->range_start, node->id, true);
+}
+
+// The successor's range lock fences writes to the part of its range that
+// moves to the new node; other joins and leaves only wait for the short
+// membership update. Both locks are taken in id order before the new node
+// becomes visible, so a concurrent leave of its predecessor waits for the
+// handoff.
+void ChordEngine::join(Node* node, Node* contact) {
+    if (!contact) {
+        std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+        DHT_NODES.push_back(node);
+        publish_members();
+        update_all_finger_tables();
+        node->range_start = node->id;
+        node->epoch++;
+        node->alive = true;
+    } else {
+        Node* succ = nullptr;
+        std::unique_lock<std::shared_mutex> first_range;
+        std::unique_lock<std::shared_mutex> second_range;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+                succ = get_successor_for(node->id);
+            }
+            Node* first = node->id < succ->id ? node : succ;
+            Node* second = node->id < succ->id ? succ : node;
+            first_range = std::unique_lock<std::shared_mutex>(first->range_mutex);
+            second_range = std::unique_lock<std::shared_mutex>(second->range_mutex);
+            std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+            if (succ->alive && get_successor_for(node->id) == succ) {
+                DHT_NODES.push_back(node);
+                publish_members();
+                node->update_finger_table();
+                update_all_finger_tables();
+                break;
+            }
+            second_range.unlock();
+            first_range.unlock();
+        }
+        int pred = succ->range_start;
+
+        std::vector<int> migrated;
+        record_migration(succ->keys->move_range(node->keys, pred, node->id,
+                                                LOG_MIGRATIONS ? &migrated : nullptr));
+        succ->count_keys();
+        node->count_keys();
+        node->range_start = pred;
+        succ->range_start = node->id;
+        node->epoch++;
+        succ->epoch++;
+        node->alive = true;
+        second_range.unlock();
+        first_range.unlock();
+
+        if (LOG_MIGRATIONS && !migrated.empty()) {
+            std::cout << "Migrated keys from node "
+                      << succ->id << " to node " << node->id << ": ";
+            for (size_t i = 0; i < migrated.size(); i++) {
+                std::cout << migrated[i];
+                if (i + 1 < migrated.size()) {
+                    std::cout << " ";
+                }
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+// Both range locks are taken in id order so adjacent leaves cannot deadlock.
+// The departing range moves first so tiered stores can hand whole runs
+// over; anything left (keys that bounded-load or two-choices placement put
+// here from outside the range) follows.
+void ChordEngine::leave(Node* node) {
+    while (true) {
+        Node* succ = nullptr;
+        {
+            std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+            succ = get_next_node(node);
+        }
+        Node* first = node->id < succ->id ? node : succ;
+        Node* second = node->id < succ->id ? succ : node;
+        std::unique_lock<std::shared_mutex> first_range(first->range_mutex);
+        std::unique_lock<std::shared_mutex> second_range;
+        if (second != first) {
+            second_range = std::unique_lock<std::shared_mutex>(second->range_mutex);
+        }
+        std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+        if (get_next_node(node) != succ) {
+            continue;
+        }
+
+        size_t moved = node->keys->move_range(succ->keys, node->range_start, node->id);
+        if (node->keys->size() > 0) {
+            moved += node->keys->move_range(succ->keys, node->id, node->id);
+        }
+        node->count_keys();
+        succ->count_keys();
+        record_migration(moved);
+        succ->range_start = node->range_start.load();
+        succ->epoch++;
+        node->epoch++;
+        node->alive = false;
+        auto it = std::find(DHT_NODES.begin(), DHT_NODES.end(), node);
+        if (it != DHT_NODES.end()) {
+            DHT_NODES.erase(it);
+        }
+        publish_members();
+        update_all_finger_tables();
+        return;
+    }
+}
+
+Node* KademliaEngine::owner_of(int key) {
+    return get_xor_closest(key);
+}
+
+std::pair<Node*, Path> KademliaEngine::find_key(Node* from, int key) {
+    Path path;
+    path.push_back(from->id);
+
+    Node* current = from;
+    while (true) {
+        Node* next_node = current->kbuckets->closest_to(key);
+        if (next_node == current) {
+            return {current, path};
+        }
+        current = next_node;
+        path.push_back(current->id);
+    }
+}
+
+size_t KademliaEngine::table_size(Node* node) const {
+    size_t size = 0;
+    for (auto& bucket : node->kbuckets->snapshot()->buckets) {
+        size += bucket.size();
+    }
+    return size;
+}
+
+void KademliaEngine::rebuild() {
+    update_all_kbuckets();
+}
+
+// Reads the published member list, not DHT_NODES: a change elsewhere in the
+// id space may be updating DHT_NODES meanwhile. Changes that move keys to
+// or from `node` hold its range lock (see lock_xor_group), so a caller
+// holding it sees a stable answer. A departed node is never alive again.
+bool KademliaEngine::owns(Node* node, int key) {
+    if (!node->alive) {
+        return false;
+    }
+    EpochGuard guard;
+    Node* best = nullptr;
+    for (Node* member : MEMBERS.load(std::memory_order_acquire)->nodes) {
+        if (!best || (member->id ^ key) < (best->id ^ key)) {
+            best = member;
+        }
+    }
+    return best == node;
+}
+
+// The members that share the longest id prefix with `node`. They are the
+// only ones whose keys can move to `node` when it joins, or that receive its
+// keys when it leaves: every other key keeps a closer owner. They form one
+// subtree of the id space, so in a large ring they are a few neighbours.
+std::vector<Node*> xor_neighbours(Node* node) {
+    int nearest = MAX_ID;
+    for (Node* member : DHT_NODES) {
+        if (member != node) {
+            nearest = std::min(nearest, member->id ^ node->id);
+        }
+    }
+    int limit = 1;
+    while (limit <= nearest) {
+        limit <<= 1;
+    }
+    std::vector<Node*> neighbours;
+    for (Node* member : DHT_NODES) {
+        if (member != node && (member->id ^ node->id) < limit) {
+            neighbours.push_back(member);
+        }
+    }
+    return neighbours;
+}
+
+// Locks the range of `node` and its xor_neighbours exclusively, in id
+// order, then MEMBERSHIP_MUTEX, retrying until the neighbours it locked are
+// still current. Changes in other parts of the id space run alongside, and
+// writes to owners outside the group go on; fenced writes to the group see
+// the bumped epochs and reroute.
+std::vector<std::unique_lock<std::shared_mutex>> lock_xor_group(
+        Node* node, std::unique_lock<std::mutex>& membership) {
+    auto by_id = [](Node* a, Node* b){ return a->id < b->id || (a->id == b->id && a < b); };
+    while (true) {
+        std::vector<Node*> group;
+        {
+            std::lock_guard<std::mutex> snapshot(MEMBERSHIP_MUTEX);
+            group = xor_neighbours(node);
+        }
+        group.push_back(node);
+        std::sort(group.begin(), group.end(), by_id);
+        std::vector<std::unique_lock<std::shared_mutex>> ranges;
+        for (Node* member : group) {
+            ranges.emplace_back(member->range_mutex);
+        }
+        membership = std::unique_lock<std::mutex>(MEMBERSHIP_MUTEX);
+        std::vector<Node*> current = xor_neighbours(node);
+        current.push_back(node);
+        std::sort(current.begin(), current.end(), by_id);
+        if (current == group) {
+            return ranges;
+        }
+        membership.unlock();
+    }
+}
+
+void KademliaEngine::join(Node* node, Node* contact) {
+    std::unique_lock<std::mutex> membership;
+    std::vector<std::unique_lock<std::shared_mutex>> ranges = lock_xor_group(node, membership);
+    std::vector<Node*> donors = xor_neighbours(node);
+    DHT_NODES.push_back(node);
+    publish_members();
+    node->kbuckets->update();
+    update_all_kbuckets();
+    node->epoch++;
+    node->alive = true;
+    membership.unlock();
+    if (!contact) {
+        return;
+    }
+    // A donor's key moves if the new node is closer to it than the donor,
+    // which was its closest member until now.
+    for (Node* other : donors) {
+        std::vector<int> migrated;
+        for (auto& kv : other->keys->items()) {
+            if ((node->id ^ kv.first) < (other->id ^ kv.first)) {
+                node->keys->put(kv.first, kv.second);
+                other->keys->erase(kv.first);
+                migrated.push_back(kv.first);
+            }
+        }
+        other->count_keys();
+        node->count_keys();
+        if (!migrated.empty()) {
+            other->epoch++;
+        }
+        record_migration(migrated.size());
+        if (LOG_MIGRATIONS && !migrated.empty()) {
+            std::cout << "Migrated keys from node "
+                      << other->id << " to node " << node->id << ": ";
+            for (size_t i = 0; i < migrated.size(); i++) {
+                std::cout << migrated[i];
+                if (i + 1 < migrated.size()) {
+                    std::cout << " ";
+                }
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+void KademliaEngine::leave(Node* node) {
+    std::unique_lock<std::mutex> membership;
+    std::vector<std::unique_lock<std::shared_mutex>> ranges = lock_xor_group(node, membership);
+    std::vector<Node*> receivers = xor_neighbours(node);
+    node->epoch++;
+    node->alive = false;
+    auto it = std::find(DHT_NODES.begin(), DHT_NODES.end(), node);
+    if (it != DHT_NODES.end()) {
+        DHT_NODES.erase(it);
+    }
+    publish_members();
+    if (DHT_NODES.empty()) {
+        return;
+    }
+    update_all_kbuckets();
+    membership.unlock();
+    KeyList handed_over = node->keys->items();
+    for (auto& kv : handed_over) {
+        Node* receiver = receivers[0];
+        for (Node* candidate : receivers) {
+            if ((candidate->id ^ kv.first) < (receiver->id ^ kv.first)) {
+                receiver = candidate;
+            }
+        }
+        receiver->keys->put(kv.first, kv.second);
+    }
+    for (Node* receiver : receivers) {
+        receiver->count_keys();
+        receiver->epoch++;
+    }
+    record_migration(handed_over.size());
+}
+
+std::pair<Node*, Path> SymphonyEngine::find_key(Node* from, int key) {
+    Path path;
+    path.push_back(from->id);
+
+    Node* current = from;
+    while (true) {
+        const SymphonyRow* row = current->symphony->snapshot();
+        Node* succ = row->successor;
+        if (in_interval(key, current->id, succ->id, true)) {
+            path.push_back(succ->id);
+            return {succ, path};
+        }
+        Node* next_node = current->symphony->closest_preceding_link(row, key);
+        if (next_node == current) {
+            next_node = succ;
+        }
+        current = next_node;
+        path.push_back(current->id);
+    }
+}
+
+size_t SymphonyEngine::table_size(Node* node) const {
+    return 1 + node->symphony->snapshot()->links.size();
+}
+
+void SymphonyEngine::rebuild() {
+    update_all_symphony_tables();
+}
+
+void SymphonyEngine::join(Node* node, Node* contact) {
+    ChordEngine::join(node, contact);
+    std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+    // Built first so no reader reaches the node before it has a successor.
+    node->symphony->update();
+    update_all_symphony_tables();
+}
+
+void SymphonyEngine::leave(Node* node) {
+    ChordEngine::leave(node);
+    std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+    update_all_symphony_tables();
+}
+
+void update_all_finger_tables() {
+    for (Node* node : DHT_NODES) {
+        node->update_finger_table();
+    }
+}
+
+Node* get_successor_for(int key) {
+    std::vector<Node*> sorted_nodes(DHT_NODES.begin(), DHT_NODES.end());
+    std::sort(sorted_nodes.begin(), sorted_nodes.end(),
+              [](Node* a, Node* b){ return a->id < b->id; });
+
+    for (Node* node : sorted_nodes) {
+        if (node->id >= key) {
+            return node;
+        }
+    }
+    return sorted_nodes[0];
+}
+
+void update_all_kbuckets() {
+    for (Node* node : DHT_NODES) {
+        node->kbuckets->update();
+    }
+}
+
+void update_all_symphony_tables() {
+    for (Node* node : DHT_NODES) {
+        node->symphony->update();
+    }
+}
+
+// Multiplicative hash keeping the top M bits: an independent second position
+// on the ring for two-choices placement.
+int second_choice_hash(int key) {
+    return static_cast<int>((static_cast<unsigned>(key) * 2654435761u) >> (32 - M));
+}
+
+size_t count_stored_keys() {
+    size_t total = 0;
+    for (Node* node : DHT_NODES) {
+        total += node->keys->size();
+    }
+    return total;
+}
+
+// Membership changes shift every primary owner's capacity and successor
+// chain, so non-successor placements are recomputed from scratch.
+void rebalance_placement() {
+    std::map<int,int> all_keys;
+    for (Node* node : DHT_NODES) {
+        for (auto& kv : node->keys->items()) {
+            all_keys.insert(kv);
+        }
+        node->keys->clear();
+        node->count_keys();
+        node->overflow.clear();
+        node->redirects.clear();
+    }
+    for (auto& kv : all_keys) {
+        ROUTING_ENGINE->owner_of(kv.first)->store_key(kv.first, kv.second);
+    }
+}
+
+// Called with MEMBERSHIP_MUTEX held (or no concurrent membership change)
+// after every change to DHT_NODES.
+void publish_members() {
+    MemberList* fresh = new MemberList();
+    fresh->nodes.assign(DHT_NODES.begin(), DHT_NODES.end());
+    RECLAIMER.retire(MEMBERS.exchange(fresh, std::memory_order_acq_rel));
+}
+
+Node* get_xor_closest(int key) {
+    Node* best = nullptr;
+    for (Node* node : DHT_NODES) {
+        if (!best || (node->id ^ key) < (best->id ^ key)) {
+            best = node;
+        }
+    }
+    return best;
+}
+
+Node* get_next_node(Node* node) {
+    std::vector<Node*> sorted_nodes(DHT_NODES.begin(), DHT_NODES.end());
+    std::sort(sorted_nodes.begin(), sorted_nodes.end(),
+              [](Node* a, Node* b){ return a->id < b->id; });
+
+    auto it = std::find(sorted_nodes.begin(), sorted_nodes.end(), node);
+    if (it == sorted_nodes.end()) {
+        return nullptr;
+    }
+
+    size_t idx = std::distance(sorted_nodes.begin(), it);
+    return sorted_nodes[(idx + 1) % sorted_nodes.size()];
+}
+
+Node* get_predecessor(Node* node) {
+    std::vector<Node*> sorted_nodes(DHT_NODES.begin(), DHT_NODES.end());
+    std::sort(sorted_nodes.begin(), sorted_nodes.end(),
+              [](Node* a, Node* b){ return a->id < b->id; });
+
+    auto it = std::find(sorted_nodes.begin(), sorted_nodes.end(), node);
+    if (it == sorted_nodes.end()) {
+        return nullptr;
+    }
+
+    size_t idx = std::distance(sorted_nodes.begin(), it);
+    if (idx == 0) {
+        return sorted_nodes[sorted_nodes.size() - 1];
+    } else {
+        return sorted_nodes[idx - 1];
+    }
+}
+
+std::vector<Node*> build_random_ring(int n, std::mt19937& rng) {
+    std::vector<int> ids(MAX_ID);
+    for (int i = 0; i < MAX_ID; i++) {
+        ids[i] = i;
+    }
+    std::shuffle(ids.begin(), ids.end(), rng);
+
+    std::vector<Node*> nodes;
+    for (int i = 0; i < n; i++) {
+        Node* node = new Node(ids[i]);
+        node->join(nodes.empty() ? nullptr : nodes[0]);
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+static std::vector<Node*> CRASHED_NODES;
+
+// Deletes every member and crashed node; nodes that left are already owned
+// by RECLAIMER and are freed by draining it.
+// Blob keys still in the ring drop their store's reference. release()
+// only frees blobs bound to the key they are stored under, so plain
+// values are skipped.
+void destroy_ring() {
+    if (BLOBS.live_blobs() > 0) {
+        for (std::vector<Node*>* ring : {&DHT_NODES, &CRASHED_NODES}) {
+            for (Node* node : *ring) {
+                for (auto& kv : node->keys->items()) {
+                    BLOBS.release(kv.second, kv.first);
+                }
+            }
+        }
+    }
+    for (Node* node : DHT_NODES) {
+        delete node;
+    }
+    DHT_NODES.clear();
+    publish_members();
+    for (Node* node : CRASHED_NODES) {
+        delete node;
+    }
+    CRASHED_NODES.clear();
+    RECLAIMER.drain();
+}
+
+// Simulated crash: the node disappears without handing over its keys and
+// without anybody repairing their routing state. Stale tables may still
+// point at it, so it is only freed by destroy_ring().
+void crash_node(Node* node) {
+    auto it = std::find(DHT_NODES.begin(), DHT_NODES.end(), node);
+    if (it != DHT_NODES.end()) {
+        DHT_NODES.erase(it);
+    }
+    publish_members();
+    node->alive = false;
+    Node* succ = get_successor_for(node->id);
+    succ->range_start = node->range_start.load();
+    succ->epoch++;
+    CRASHED_NODES.push_back(node);
+}
+
+struct RingCheck {
+    size_t nodes;
+    size_t entries_checked;
+    size_t bad_fingers;
+    size_t bad_buckets;
+    size_t bad_successors;
+    size_t bad_ranges;
+    size_t keys_checked;
+    size_t misplaced_keys;
+
+    bool consistent() const {
+        return bad_fingers == 0 && bad_buckets == 0 && bad_successors == 0 && bad_ranges == 0 &&
+               misplaced_keys == 0;
+    }
+};
+
+// XOR-closest id in a sorted id list: walk the implicit binary trie one bit
+// at a time, keeping the key's bit whenever that half of the range is
+// non-empty.
+int xor_closest_sorted(const std::vector<int>& ids, int key) {
+    size_t lo = 0;
+    size_t hi = ids.size();
+    int prefix = 0;
+    for (int b = M - 1; b >= 0; b--) {
+        size_t mid = std::lower_bound(ids.begin() + lo, ids.begin() + hi,
+                                      prefix | (1 << b)) - ids.begin();
+        bool want_one = (key >> b) & 1;
+        if ((want_one && mid < hi) || (!want_one && lo == mid)) {
+            lo = mid;
+            prefix |= 1 << b;
+        } else {
+            hi = mid;
+        }
+    }
+    return ids[lo];
+}
+
+// Number of ids whose XOR distance from `self` is below `limit`, counted as
+// at most M contiguous id ranges.
+size_t count_xor_below(const std::vector<int>& ids, int self, int limit) {
+    size_t count = 0;
+    for (int b = M - 1; b >= 0; b--) {
+        if ((limit >> b) & 1) {
+            int high = ((self ^ limit) >> (b + 1)) << (b + 1);
+            int base = high | (self & (1 << b));
+            count += std::lower_bound(ids.begin(), ids.end(), base + (1 << b)) -
+                     std::lower_bound(ids.begin(), ids.end(), base);
+        }
+    }
+    return count;
+}
+
+// Bucket i must hold the min(KADEMLIA_K, members at XOR distance
+// [2^i, 2^(i+1))) closest current members of that range, in distance order.
+size_t check_kbuckets(Node* node, const std::vector<Node*>& sorted,
+                      const std::vector<int>& ids, RingCheck& check) {
+    size_t bad = 0;
+    for (int i = 0; i < M; i++) {
+        const RoutingList& bucket = node->kbuckets->snapshot()->buckets[i];
+        check.entries_checked += bucket.size();
+        size_t below = count_xor_below(ids, node->id, 1 << i);
+        size_t in_range = count_xor_below(ids, node->id, 1 << (i + 1)) - below;
+        if (bucket.size() != std::min(in_range, static_cast<size_t>(KADEMLIA_K))) {
+            bad++;
+            continue;
+        }
+        int previous = 0;
+        for (Node* contact : bucket) {
+            int distance = contact->id ^ node->id;
+            size_t at = std::lower_bound(ids.begin(), ids.end(), contact->id) - ids.begin();
+            if (at == ids.size() || sorted[at] != contact ||
+                distance < (1 << i) || distance >= (1 << (i + 1)) || distance <= previous) {
+                bad++;
+                break;
+            }
+            previous = distance;
+        }
+        if (!bucket.empty() &&
+            count_xor_below(ids, node->id, previous) - below != bucket.size() - 1) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+// Checks one slice of the sorted ring. Finger i of a node must point at the
+// first member at or after id + 2^i, found by binary search in `ids`, so a
+// full check is O(n * M log n). The node's de-duplicated row is walked
+// alongside.
+void check_ring_slice(const std::vector<Node*>& sorted, const std::vector<int>& ids,
+                      size_t begin, size_t end, RingCheck& check) {
+    size_t n = sorted.size();
+    bool kademlia = ROUTING_ENGINE == &KADEMLIA_ENGINE;
+    bool symphony = ROUTING_ENGINE == &SYMPHONY_ENGINE;
+    for (size_t pos = begin; pos < end; pos++) {
+        Node* node = sorted[pos];
+        Node* ideal_successor = sorted[(pos + 1) % n];
+        check.nodes++;
+        if (kademlia) {
+            check.bad_buckets += check_kbuckets(node, sorted, ids, check);
+        } else {
+            const FingerList& fingers = node->finger->snapshot()->fingers;
+            size_t f = 0;
+            Node* current = nullptr;
+            for (int i = 0; i < M; i++) {
+                int offset = 1 << i;
+                while (f < fingers.size() &&
+                       (fingers[f].start - node->id + MAX_ID) % MAX_ID <= offset) {
+                    if (current == fingers[f].target) {
+                        check.bad_fingers++;
+                    }
+                    current = fingers[f].target;
+                    f++;
+                }
+                int start = (node->id + offset) % MAX_ID;
+                size_t expected = std::lower_bound(ids.begin(), ids.end(), start) - ids.begin();
+                check.entries_checked++;
+                if (current != sorted[expected % n]) {
+                    check.bad_fingers++;
+                }
+            }
+            Node* successor = symphony ? node->symphony->snapshot()->successor : node->get_successor();
+            if (successor != ideal_successor) {
+                check.bad_successors++;
+            }
+            if (node->range_start != sorted[(pos + n - 1) % n]->id) {
+                check.bad_ranges++;
+            }
+        }
+
+        for (auto& kv : node->keys->items()) {
+            int key = kv.first;
+            Node* owner;
+            if (kademlia) {
+                int closest = xor_closest_sorted(ids, key);
+                owner = sorted[std::lower_bound(ids.begin(), ids.end(), closest) - ids.begin()];
+            } else {
+                size_t at = std::lower_bound(ids.begin(), ids.end(), key) - ids.begin();
+                owner = sorted[at % n];
+            }
+            Node* holder = PLACEMENT == PLACEMENT_SUCCESSOR ? owner : owner->locate_key(key);
+            check.keys_checked++;
+            if (holder != node) {
+                check.misplaced_keys++;
+            }
+        }
+    }
+}
+
+// Compares every node's routing state and stored keys against the ideal
+// ring built from DHT_NODES, split over `threads` workers (0 = one per
+// core). Meant for checkpoints: no membership change may be in flight.
+RingCheck check_ring(int threads = 0) {
+    RingCheck total = {0, 0, 0, 0, 0, 0, 0, 0};
+    std::vector<Node*> sorted(DHT_NODES.begin(), DHT_NODES.end());
+    if (sorted.empty()) {
+        return total;
+    }
+    std::sort(sorted.begin(), sorted.end(), [](Node* a, Node* b){ return a->id < b->id; });
+    std::vector<int> ids;
+    for (Node* node : sorted) {
+        ids.push_back(node->id);
+    }
+
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, static_cast<int>(sorted.size()));
+    std::vector<RingCheck> partial(threads, total);
+    std::vector<std::thread> workers;
+    size_t chunk = (sorted.size() + threads - 1) / threads;
+    for (int t = 0; t < threads; t++) {
+        size_t begin = std::min(sorted.size(), t * chunk);
+        size_t end = std::min(sorted.size(), begin + chunk);
+        workers.emplace_back(check_ring_slice, std::cref(sorted), std::cref(ids),
+                             begin, end, std::ref(partial[t]));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (const RingCheck& part : partial) {
+        total.nodes += part.nodes;
+        total.entries_checked += part.entries_checked;
+        total.bad_fingers += part.bad_fingers;
+        total.bad_buckets += part.bad_buckets;
+        total.bad_successors += part.bad_successors;
+        total.bad_ranges += part.bad_ranges;
+        total.keys_checked += part.keys_checked;
+        total.misplaced_keys += part.misplaced_keys;
+    }
+    return total;
+}
+
+// Ring for a fixed node set, computed entirely at compile time: sorted
+// members, every logical finger (as a member index) and each member's owned
+// range. lookup() runs the Chord algorithm over those tables, so lookups on
+// a constexpr ring with constant arguments fold to constants.
+struct StaticLookup {
+    int owner;
+    int hops;
+};
+
+template <size_t N>
+struct StaticRing {
+    std::array<int, N> ids;
+    std::array<std::array<int, M>, N> fingers;
+    std::array<int, N> range_start;
+
+    constexpr size_t successor_index(int key) const {
+        for (size_t i = 0; i < N; i++) {
+            if (ids[i] >= key) {
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    constexpr int owner(int key) const {
+        return ids[successor_index(key)];
+    }
+
+    constexpr size_t index_of(int id) const {
+        for (size_t i = 0; i < N; i++) {
+            if (ids[i] == id) {
+                return i;
+            }
+        }
+        return N;
+    }
+
+    constexpr StaticLookup lookup(int from, int key) const {
+        size_t current = index_of(from);
+        int hops = 0;
+        while (true) {
+            size_t succ = static_cast<size_t>(fingers[current][0]);
+            if (in_interval(key, ids[current], ids[succ], true)) {
+                return {ids[succ], hops + 1};
+            }
+            size_t next = current;
+            for (int i = M - 1; i >= 0; i--) {
+                size_t finger = static_cast<size_t>(fingers[current][i]);
+                if (finger != current && in_interval(ids[finger], ids[current], key, false)) {
+                    next = finger;
+                    break;
+                }
+            }
+            hops++;
+            if (next == current) {
+                return {ids[succ], hops};
+            }
+            current = next;
+        }
+    }
+};
+
+template <size_t N>
+constexpr StaticRing<N> make_static_ring(std::array<int, N> ids) {
+    for (size_t i = 1; i < N; i++) {
+        for (size_t j = i; j > 0 && ids[j - 1] > ids[j]; j--) {
+            int swapped = ids[j];
+            ids[j] = ids[j - 1];
+            ids[j - 1] = swapped;
+        }
+    }
+    StaticRing<N> ring{};
+    ring.ids = ids;
+    for (size_t n = 0; n < N; n++) {
+        for (int i = 0; i < M; i++) {
+            ring.fingers[n][i] = static_cast<int>(
+                ring.successor_index((ids[n] + (1 << i)) % MAX_ID));
+        }
+        ring.range_start[n] = ids[(n + N - 1) % N];
+    }
+    return ring;
+}
+
+static constexpr StaticRing<6> DEMO_RING = make_static_ring<6>({0, 30, 65, 110, 160, 230});
+static_assert(DEMO_RING.owner(45) == 65, "static ring ownership");
+static_assert(DEMO_RING.owner(240) == 0, "static ring wraps");
+static_assert(DEMO_RING.lookup(0, 200).owner == 230, "static ring routing");
+static_assert(make_static_ring<1>({42}).lookup(42, 7).owner == 42, "a lone node owns every key");
+
+// Brings a static ring to life without joins: nodes get their finger rows,
+// ranges and epochs straight from the precomputed tables, skipping the
+// per-join sort and rebuild. Only Chord routing state is filled in.
+template <size_t N>
+std::vector<Node*> instantiate_static_ring(const StaticRing<N>& ring) {
+    std::vector<Node*> nodes;
+    for (size_t n = 0; n < N; n++) {
+        nodes.push_back(new Node(ring.ids[n]));
+    }
+    for (size_t n = 0; n < N; n++) {
+        FingerRow* row = new FingerRow();
+        for (int i = 0; i < M; i++) {
+            Node* target = nodes[ring.fingers[n][i]];
+            if (row->fingers.empty() || row->fingers.back().target != target) {
+                row->fingers.push_back({(ring.ids[n] + (1 << i)) % MAX_ID, target->id, target});
+            }
+        }
+        RECLAIMER.retire(nodes[n]->finger->row.exchange(row, std::memory_order_acq_rel));
+        nodes[n]->range_start = ring.range_start[n];
+        nodes[n]->epoch++;
+        nodes[n]->alive = true;
+    }
+    std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+    DHT_NODES.insert(DHT_NODES.end(), nodes.begin(), nodes.end());
+    return nodes;
+}
+
+// Straightforward model of the ring for shadow runs: members and their keys
+// in plain maps, owners found by linear scan, and Chord routing over finger
+// tables recomputed on every hop. It never touches DHT_NODES.
+class ReferenceRing {
+public:
+    explicit ReferenceRing(bool xor_metric) : xor_owner(xor_metric) {}
+
+    int successor_of(int key) const;
+    int owner(int key) const;
+    std::vector<int> route(int from, int key) const;
+    void join(int id);
+    void leave(int id);
+    void put(int key, int value);
+    void erase(int key);
+    bool get(int key, int& value) const;
+
+    std::map<int, std::map<int,int>> members;
+
+private:
+    bool xor_owner;
+};
+
+int ReferenceRing::successor_of(int key) const {
+    for (auto& member : members) {
+        if (member.first >= key) {
+            return member.first;
+        }
+    }
+    return members.begin()->first;
+}
+
+int ReferenceRing::owner(int key) const {
+    if (!xor_owner) {
+        return successor_of(key);
+    }
+    int best = members.begin()->first;
+    for (auto& member : members) {
+        if ((member.first ^ key) < (best ^ key)) {
+            best = member.first;
+        }
+    }
+    return best;
+}
+
+std::vector<int> ReferenceRing::route(int from, int key) const {
+    std::vector<int> path{from};
+    int current = from;
+    while (true) {
+        int succ = successor_of((current + 1) % MAX_ID);
+        if (in_interval(key, current, succ, true)) {
+            path.push_back(succ);
+            return path;
+        }
+        int next = current;
+        for (int i = M - 1; i >= 0; i--) {
+            int finger = successor_of((current + (1 << i)) % MAX_ID);
+            if (finger != current && in_interval(finger, current, key, false)) {
+                next = finger;
+                break;
+            }
+        }
+        if (next == current) {
+            path.push_back(succ);
+            return path;
+        }
+        current = next;
+        path.push_back(current);
+    }
+}
+
+void ReferenceRing::join(int id) {
+    members[id];
+    for (auto& member : members) {
+        if (member.first == id) {
+            continue;
+        }
+        for (auto it = member.second.begin(); it != member.second.end();) {
+            if (owner(it->first) == id) {
+                members[id][it->first] = it->second;
+                it = member.second.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void ReferenceRing::leave(int id) {
+    std::map<int,int> keys = members[id];
+    members.erase(id);
+    for (auto& kv : keys) {
+        members[owner(kv.first)][kv.first] = kv.second;
+    }
+}
+
+void ReferenceRing::put(int key, int value) {
+    members[owner(key)][key] = value;
+}
+
+void ReferenceRing::erase(int key) {
+    members[owner(key)].erase(key);
+}
+
+bool ReferenceRing::get(int key, int& value) const {
+    const std::map<int,int>& keys = members.at(owner(key));
+    auto it = keys.find(key);
+    if (it == keys.end()) {
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+enum ShadowOpKind {
+    SHADOW_FIND,
+    SHADOW_INSERT,
+    SHADOW_REMOVE,
+    SHADOW_JOIN,
+    SHADOW_LEAVE,
+    SHADOW_OP_COUNT
+};
+
+static const char* SHADOW_OP_NAMES[SHADOW_OP_COUNT] = {"find", "insert", "remove", "join", "leave"};
+
+struct ShadowOp {
+    ShadowOpKind kind;
+    int node;
+    int contact;
+    int key;
+    int value;
+};
+
+struct ShadowReport {
+    long ops[SHADOW_OP_COUNT];
+    double optimized_ns[SHADOW_OP_COUNT];
+    double reference_ns[SHADOW_OP_COUNT];
+    long divergences[SHADOW_OP_COUNT];
+    bool distribution_matches;
+    std::vector<std::string> samples;
+};
+
+// Joins of `initial_nodes` distinct ids followed by a random mix of
+// lookups, writes and membership changes; at least two members stay.
+std::vector<ShadowOp> make_shadow_stream(int initial_nodes, int ops, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<int> ids(MAX_ID);
+    for (int i = 0; i < MAX_ID; i++) {
+        ids[i] = i;
+    }
+    std::shuffle(ids.begin(), ids.end(), rng);
+    std::vector<int> members;
+    std::vector<int> free_ids(ids.begin() + initial_nodes, ids.end());
+    std::vector<ShadowOp> stream;
+    for (int i = 0; i < initial_nodes; i++) {
+        stream.push_back({SHADOW_JOIN, ids[i], members.empty() ? -1 : members[0], 0, 0});
+        members.push_back(ids[i]);
+    }
+    for (int i = 0; i < ops; i++) {
+        unsigned roll = rng() % 100;
+        int contact = members[rng() % members.size()];
+        int key = static_cast<int>(rng() % MAX_ID);
+        if (roll < 70) {
+            stream.push_back({SHADOW_FIND, contact, contact, key, 0});
+        } else if (roll < 85) {
+            stream.push_back({SHADOW_INSERT, contact, contact, key, i});
+        } else if (roll < 90) {
+            stream.push_back({SHADOW_REMOVE, contact, contact, key, 0});
+        } else if (roll < 95 && !free_ids.empty()) {
+            size_t pick = rng() % free_ids.size();
+            stream.push_back({SHADOW_JOIN, free_ids[pick], contact, 0, 0});
+            members.push_back(free_ids[pick]);
+            free_ids.erase(free_ids.begin() + pick);
+        } else if (members.size() > 2) {
+            size_t pick = rng() % members.size();
+            stream.push_back({SHADOW_LEAVE, members[pick], -1, 0, 0});
+            free_ids.push_back(members[pick]);
+            members.erase(members.begin() + pick);
+        }
+    }
+    return stream;
+}
+
+// Replays one stream on the live ring under `engine` and on a
+// ReferenceRing, timing each side per operation class. Owners and values
+// are always compared; paths only for Chord, whose routing the reference
+// reproduces. Runs on an empty ring and leaves it empty; nothing is added
+// to the production code paths.
+ShadowReport run_shadow(RoutingEngine* engine, const std::vector<ShadowOp>& stream) {
+    set_routing_engine(engine);
+    ReferenceRing reference(engine == &KADEMLIA_ENGINE);
+    std::map<int, Node*> live;
+    ShadowReport report = {};
+    auto diverge = [&](ShadowOpKind kind, const std::string& what) {
+        report.divergences[kind]++;
+        if (report.samples.size() < 3) {
+            report.samples.push_back(std::string(SHADOW_OP_NAMES[kind]) + ": " + what);
+        }
+    };
+
+    for (const ShadowOp& op : stream) {
+        auto begin = std::chrono::steady_clock::now();
+        std::pair<Node*, Path> found;
+        switch (op.kind) {
+        case SHADOW_FIND:
+            found = live[op.contact]->find_key(op.key);
+            break;
+        case SHADOW_INSERT:
+            live[op.contact]->insert_key(op.key, op.value);
+            break;
+        case SHADOW_REMOVE:
+            live[op.contact]->remove_key(op.key);
+            break;
+        case SHADOW_JOIN:
+            live[op.node] = new Node(op.node);
+            live[op.node]->join(op.contact < 0 ? nullptr : live[op.contact]);
+            break;
+        case SHADOW_LEAVE:
+            live[op.node]->leave();
+            live.erase(op.node);
+            break;
+        default:
+            break;
+        }
+        auto middle = std::chrono::steady_clock::now();
+        std::vector<int> expected_path;
+        switch (op.kind) {
+        case SHADOW_FIND:
+            expected_path = reference.route(op.contact, op.key);
+            break;
+        case SHADOW_INSERT:
+            reference.put(op.key, op.value);
+            break;
+        case SHADOW_REMOVE:
+            reference.erase(op.key);
+            break;
+        case SHADOW_JOIN:
+            reference.join(op.node);
+            break;
+        case SHADOW_LEAVE:
+            reference.leave(op.node);
+            break;
+        default:
+            break;
+        }
+        auto end = std::chrono::steady_clock::now();
+        report.ops[op.kind]++;
+        report.optimized_ns[op.kind] += std::chrono::duration<double, std::nano>(middle - begin).count();
+        report.reference_ns[op.kind] += std::chrono::duration<double, std::nano>(end - middle).count();
+
+        if (op.kind == SHADOW_FIND) {
+            int owner = reference.owner(op.key);
+            if (found.first->id != owner) {
+                diverge(op.kind, "key " + std::to_string(op.key) + " owner " +
+                        std::to_string(found.first->id) + " vs " + std::to_string(owner));
+            } else if (engine == &CHORD_ENGINE &&
+                       std::vector<int>(found.second.begin(), found.second.end()) != expected_path) {
+                diverge(op.kind, "key " + std::to_string(op.key) + " path differs from node " +
+                        std::to_string(op.contact));
+            }
+        } else if (op.kind == SHADOW_INSERT || op.kind == SHADOW_REMOVE) {
+            int value = -1;
+            int expected = -1;
+            live[op.contact]->find_key(op.key).first->keys->get(op.key, value);
+            reference.get(op.key, expected);
+            if (value != expected) {
+                diverge(op.kind, "key " + std::to_string(op.key) + " value " +
+                        std::to_string(value) + " vs " + std::to_string(expected));
+            }
+        } else if (live.size() != reference.members.size()) {
+            diverge(op.kind, "member count " + std::to_string(live.size()) + " vs " +
+                    std::to_string(reference.members.size()));
+        }
+    }
+
+    report.distribution_matches = live.size() == reference.members.size();
+    for (auto& member : live) {
+        auto it = reference.members.find(member.first);
+        if (it == reference.members.end() ||
+            member.second->keys->items() != KeyList(it->second.begin(), it->second.end())) {
+            report.distribution_matches = false;
+        }
+    }
+    destroy_ring();
+    set_routing_engine(&CHORD_ENGINE);
+    return report;
+}
+
+struct RoutingStats {
+    double avg_hops;
+    int max_hops;
+    double avg_table_size;
+    double ns_per_lookup;
+    double churn_success;
+};
+
+RoutingStats measure_routing(RoutingEngine* engine, int n, unsigned seed) {
+    std::mt19937 rng(seed);
+    set_routing_engine(engine);
+    std::vector<Node*> nodes = build_random_ring(n, rng);
+
+    for (int key = 0; key < MAX_ID; key++) {
+        nodes[rng() % nodes.size()]->insert_key(key, key);
+    }
+
+    RoutingStats stats = {0.0, 0, 0.0, 0.0, 0.0};
+    for (Node* node : nodes) {
+        stats.avg_table_size += engine->table_size(node);
+    }
+    stats.avg_table_size /= nodes.size();
+
+    long total_hops = 0;
+    long lookups = 0;
+    const int rounds = 50;
+    auto begin = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (int key = 0; key < MAX_ID; key++) {
+            auto result = nodes[rng() % nodes.size()]->find_key(key);
+            int hops = static_cast<int>(result.second.size()) - 1;
+            total_hops += hops;
+            stats.max_hops = std::max(stats.max_hops, hops);
+            lookups++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    stats.avg_hops = static_cast<double>(total_hops) / lookups;
+    stats.ns_per_lookup =
+        std::chrono::duration<double, std::nano>(end - begin).count() / lookups;
+
+    std::vector<Node*> victims(nodes.begin(), nodes.end());
+    std::shuffle(victims.begin(), victims.end(), rng);
+    victims.resize(nodes.size() / 5);
+    for (Node* victim : victims) {
+        crash_node(victim);
+    }
+    int resolved = 0;
+    for (int key = 0; key < MAX_ID; key++) {
+        Node* start = DHT_NODES[rng() % DHT_NODES.size()];
+        Node* owner = start->find_key(key).first;
+        if (owner->alive && owner == engine->owner_of(key)) {
+            resolved++;
+        }
+    }
+    stats.churn_success = static_cast<double>(resolved) / MAX_ID;
+
+    destroy_ring();
+    set_routing_engine(&CHORD_ENGINE);
+    return stats;
+}
+
+// Timed lookup loops store their results here so the reads stay live.
+static volatile long BENCH_SINK = 0;
+
+void benchmark_routing_engines() {
+    std::vector<RoutingEngine*> engines{&CHORD_ENGINE, &KADEMLIA_ENGINE,
+                                       &SYMPHONY_ENGINE};
+    for (int n : {16, 64, 200}) {
+        std::cout << "Routing engines, " << n << " nodes, "
+                  << MAX_ID << " keys:" << std::endl;
+        std::cout << std::left << std::setw(10) << "engine"
+                  << std::right << std::setw(10) << "avg hops"
+                  << std::setw(10) << "max hops"
+                  << std::setw(10) << "entries"
+                  << std::setw(12) << "ns/lookup"
+                  << std::setw(16) << "churn success" << std::endl;
+        for (RoutingEngine* engine : engines) {
+            RoutingStats stats = measure_routing(engine, n, 42);
+            std::cout << std::left << std::setw(10) << engine->name()
+                      << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(10) << stats.avg_hops
+                      << std::setw(10) << stats.max_hops
+                      << std::setw(10) << stats.avg_table_size
+                      << std::setw(12) << stats.ns_per_lookup
+                      << std::setw(15) << stats.churn_success * 100 << "%"
+                      << std::endl;
+        }
+        std::cout << std::endl;
+    }
+}
+
+void benchmark_symphony_links() {
+    const int n = 200;
+    int saved_links = SYMPHONY_LINKS;
+    std::cout << "Symphony long links, " << n << " nodes:" << std::endl;
+    std::cout << std::setw(6) << "k"
+              << std::setw(10) << "avg hops"
+              << std::setw(10) << "max hops"
+              << std::setw(10) << "entries" << std::endl;
+    for (int k : {1, 2, 4, 8}) {
+        SYMPHONY_LINKS = k;
+        RoutingStats stats = measure_routing(&SYMPHONY_ENGINE, n, 42);
+        std::cout << std::setw(6) << k << std::fixed << std::setprecision(2)
+                  << std::setw(10) << stats.avg_hops
+                  << std::setw(10) << stats.max_hops
+                  << std::setw(10) << stats.avg_table_size << std::endl;
+    }
+    std::cout << std::endl;
+    SYMPHONY_LINKS = saved_links;
+}
+
+struct PlacementStats {
+    size_t max_load;
+    double avg_load;
+    double load_variance;
+    double avg_hops;
+    double avg_extra_probes;
+    int max_extra_probes;
+};
+
+PlacementStats measure_placement(const std::vector<int>& keys, int n, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<Node*> nodes = build_random_ring(n, rng);
+    for (int key : keys) {
+        nodes[rng() % nodes.size()]->insert_key(key, key);
+    }
+
+    PlacementStats stats = {0, 0.0, 0.0, 0.0, 0.0, 0};
+    for (Node* node : nodes) {
+        stats.max_load = std::max(stats.max_load, node->keys->size());
+    }
+    stats.avg_load = static_cast<double>(count_stored_keys()) / nodes.size();
+    for (Node* node : nodes) {
+        double diff = node->keys->size() - stats.avg_load;
+        stats.load_variance += diff * diff / nodes.size();
+    }
+    long total_hops = 0;
+    long total_probes = 0;
+    for (int key : keys) {
+        int probes = 0;
+        Node* start = nodes[rng() % nodes.size()];
+        total_hops += start->find_key(key).second.size() - 1;
+        Node* primary = ROUTING_ENGINE->find_key(start, key).first;
+        primary->locate_key(key, &probes);
+        total_probes += probes;
+        stats.max_extra_probes = std::max(stats.max_extra_probes, probes);
+    }
+    stats.avg_hops = static_cast<double>(total_hops) / keys.size();
+    stats.avg_extra_probes = static_cast<double>(total_probes) / keys.size();
+
+    destroy_ring();
+    return stats;
+}
+
+void print_placement_header() {
+    std::cout << std::left << std::setw(16) << "placement" << std::right
+              << std::setw(10) << "max load"
+              << std::setw(10) << "max/avg"
+              << std::setw(10) << "variance"
+              << std::setw(10) << "avg hops"
+              << std::setw(14) << "extra probes"
+              << std::setw(12) << "max probes" << std::endl;
+}
+
+void print_placement_row(const std::string& label, const PlacementStats& stats) {
+    std::cout << std::left << std::setw(16) << label << std::right
+              << std::setw(10) << stats.max_load
+              << std::fixed << std::setprecision(2)
+              << std::setw(10) << stats.max_load / stats.avg_load
+              << std::setw(10) << stats.load_variance
+              << std::setw(10) << stats.avg_hops
+              << std::setw(14) << stats.avg_extra_probes
+              << std::setw(12) << stats.max_extra_probes << std::endl;
+}
+
+std::vector<int> clustered_keys(int count, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> cluster(MAX_ID / 4.0, MAX_ID / 16.0);
+    std::vector<bool> used(MAX_ID, false);
+    std::vector<int> keys;
+    while (static_cast<int>(keys.size()) < count) {
+        int key = ((static_cast<int>(std::lround(cluster(rng))) % MAX_ID) + MAX_ID) % MAX_ID;
+        if (!used[key]) {
+            used[key] = true;
+            keys.push_back(key);
+        }
+    }
+    return keys;
+}
+
+void benchmark_bounded_load() {
+    const int n = 32;
+    std::vector<int> keys = clustered_keys(96, 7);
+    std::cout << "Bounded-load placement, " << n << " nodes, "
+              << keys.size() << " clustered keys:" << std::endl;
+    print_placement_header();
+
+    print_placement_row("successor", measure_placement(keys, n, 42));
+    PLACEMENT = PLACEMENT_BOUNDED_LOAD;
+    for (double epsilon : {1.0, 0.5, 0.25, 0.1}) {
+        BOUNDED_LOAD_EPSILON = epsilon;
+        std::ostringstream label;
+        label << "eps=" << epsilon;
+        print_placement_row(label.str(), measure_placement(keys, n, 42));
+    }
+    PLACEMENT = PLACEMENT_SUCCESSOR;
+    BOUNDED_LOAD_EPSILON = 0.25;
+    std::cout << std::endl;
+}
+
+void benchmark_two_choices() {
+    const int n = 32;
+    std::vector<int> keys(MAX_ID);
+    for (int i = 0; i < MAX_ID; i++) {
+        keys[i] = i;
+    }
+    std::cout << "Two-choices placement, " << n << " nodes, "
+              << keys.size() << " keys:" << std::endl;
+    print_placement_header();
+    print_placement_row("successor", measure_placement(keys, n, 42));
+    PLACEMENT = PLACEMENT_TWO_CHOICES;
+    print_placement_row("two-choices", measure_placement(keys, n, 42));
+    PLACEMENT = PLACEMENT_SUCCESSOR;
+    std::cout << std::endl;
+}
+
+void benchmark_concurrent_repair() {
+    const int n = 128;
+    const int readers = 4;
+    std::vector<RoutingEngine*> engines{&CHORD_ENGINE, &SYMPHONY_ENGINE};
+    std::cout << "Concurrent lookups during routing repair, " << n << " nodes, "
+              << readers << " reader threads:" << std::endl;
+    std::cout << std::setw(9) << "engine"
+              << std::setw(12) << "membership"
+              << std::setw(14) << "lookups/s"
+              << std::setw(14) << "joins+leaves"
+              << std::setw(10) << "retired"
+              << std::setw(11) << "reclaimed"
+              << std::setw(10) << "pending" << std::endl;
+    for (RoutingEngine* engine : engines) {
+        set_routing_engine(engine);
+        std::mt19937 rng(42);
+        std::vector<Node*> nodes = build_random_ring(n, rng);
+        std::vector<Node*> stable(nodes.begin(), nodes.begin() + n / 2);
+        std::vector<Node*> churning(nodes.begin() + n / 2, nodes.end());
+        std::vector<bool> used(MAX_ID, false);
+        for (Node* node : nodes) {
+            used[node->id] = true;
+        }
+
+        for (bool churn : {false, true}) {
+            size_t retired_before = RECLAIMER.retired_total;
+            size_t reclaimed_before = RECLAIMER.reclaimed_total;
+            std::atomic<bool> stop(false);
+            std::atomic<long> lookups(0);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < readers; t++) {
+                threads.emplace_back([&, t]() {
+                    std::mt19937 local(t + 1);
+                    long done = 0;
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        stable[local() % stable.size()]->find_key(local() % MAX_ID);
+                        done++;
+                    }
+                    lookups += done;
+                });
+            }
+
+            int changes = 0;
+            auto begin = std::chrono::steady_clock::now();
+            auto duration = std::chrono::milliseconds(300);
+            while (std::chrono::steady_clock::now() - begin < duration) {
+                if (!churn) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                } else if (changes % 2 == 0) {
+                    size_t victim = rng() % churning.size();
+                    Node* node = churning[victim];
+                    churning.erase(churning.begin() + victim);
+                    int id = node->id;
+                    node->leave();
+                    used[id] = false;
+                    changes++;
+                } else {
+                    int id = rng() % MAX_ID;
+                    while (used[id]) {
+                        id = (id + 1) % MAX_ID;
+                    }
+                    used[id] = true;
+                    Node* node = new Node(id);
+                    node->join(stable[0]);
+                    churning.push_back(node);
+                    changes++;
+                }
+            }
+            stop = true;
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - begin).count();
+            std::cout << std::setw(9) << engine->name()
+                      << std::setw(12) << (churn ? "churn" : "static")
+                      << std::fixed << std::setprecision(0)
+                      << std::setw(14) << lookups / seconds
+                      << std::setw(14) << changes
+                      << std::setw(10) << RECLAIMER.retired_total - retired_before
+                      << std::setw(11) << RECLAIMER.reclaimed_total - reclaimed_before
+                      << std::setw(10) << RECLAIMER.pending() << std::endl;
+        }
+        destroy_ring();
+    }
+    set_routing_engine(&CHORD_ENGINE);
+    std::cout << std::endl;
+}
+
+bool key_store_matches_map(KeyStore* store, unsigned seed, int key_space = 4096) {
+    std::mt19937 rng(seed);
+    MapKeyStore reference;
+    for (int op = 0; op < 200000; op++) {
+        int key = rng() % key_space;
+        int value = 0;
+        int expected = 0;
+        switch (rng() % 4) {
+        case 0:
+        case 1:
+            store->put(key, op);
+            reference.put(key, op);
+            break;
+        case 2:
+            if (store->erase(key) != reference.erase(key)) {
+                return false;
+            }
+            break;
+        default:
+            if (store->get(key, value) != reference.get(key, expected) ||
+                value != expected) {
+                return false;
+            }
+        }
+    }
+    int a = rng() % key_space;
+    int b = rng() % key_space;
+    return store->size() == reference.size() &&
+           store->extract_range(a, b) == reference.extract_range(a, b) &&
+           store->items() == reference.items();
+}
+
+// Alternates bursts of writes with freeze() and checks every key, the
+// contents and a migration-style extraction against std::map while frozen.
+bool frozen_store_matches_map(KeyStore* store, unsigned seed, int key_space) {
+    std::mt19937 rng(seed);
+    MapKeyStore reference;
+    for (int round = 0; round < 50; round++) {
+        int writes = rng() % (2 * key_space);
+        for (int op = 0; op < writes; op++) {
+            int key = rng() % key_space;
+            int value = static_cast<int>(rng() % 100000) - 50000;
+            if (rng() % 3 == 0) {
+                if (store->erase(key) != reference.erase(key)) {
+                    return false;
+                }
+            } else {
+                store->put(key, value);
+                reference.put(key, value);
+            }
+        }
+        store->freeze();
+        for (int key = -1; key <= key_space; key++) {
+            int value = 0;
+            int expected = 0;
+            if (store->get(key, value) != reference.get(key, expected) || value != expected) {
+                return false;
+            }
+        }
+        if (store->size() != reference.size() || store->items() != reference.items()) {
+            return false;
+        }
+        if (round % 5 == 0) {
+            int a = rng() % key_space;
+            int b = rng() % key_space;
+            if (store->extract_range(a, b) != reference.extract_range(a, b)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void benchmark_key_stores() {
+    const int ops_per_thread = 200000;
+    const int key_space = 1 << 14;
+
+    ConcurrentKeyStore checked;
+    std::cout << "Key stores, one hot owner, " << key_space << " keys, "
+              << "50% put / 25% erase / 25% get:" << std::endl;
+    std::cout << "concurrent store matches std::map reference: "
+              << (key_store_matches_map(&checked, 11) ? "yes" : "NO") << std::endl;
+    std::cout << std::setw(8) << "threads"
+              << std::setw(18) << "locked map Mops/s"
+              << std::setw(18) << "concurrent Mops/s" << std::endl;
+
+    for (int threads : {1, 2, 4, 8}) {
+        double rates[2];
+        for (int kind = 0; kind < 2; kind++) {
+            KeyStore* store = kind == 0 ? static_cast<KeyStore*>(new MapKeyStore())
+                                        : new ConcurrentKeyStore();
+            std::mutex store_mutex;
+            std::vector<std::thread> workers;
+            auto begin = std::chrono::steady_clock::now();
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    std::mt19937 rng(t + 1);
+                    int value = 0;
+                    for (int op = 0; op < ops_per_thread; op++) {
+                        int key = rng() % key_space;
+                        unsigned action = rng() % 4;
+                        std::unique_lock<std::mutex> lock(store_mutex, std::defer_lock);
+                        if (kind == 0) {
+                            lock.lock();
+                        }
+                        if (action < 2) {
+                            store->put(key, op);
+                        } else if (action == 2) {
+                            store->erase(key);
+                        } else {
+                            store->get(key, value);
+                        }
+                    }
+                });
+            }
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - begin).count();
+            rates[kind] = threads * ops_per_thread / seconds / 1e6;
+            if (store->size() != store->items().size()) {
+                std::cout << "size mismatch after concurrent run" << std::endl;
+            }
+            delete store;
+        }
+        std::cout << std::setw(8) << threads << std::fixed << std::setprecision(2)
+                  << std::setw(18) << rates[0]
+                  << std::setw(18) << rates[1] << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+void benchmark_concurrent_membership() {
+    const int stable_count = 32;
+    const int writers = 2;
+    std::cout << "Concurrent membership changes with fenced writes, "
+              << stable_count << " stable nodes, " << writers
+              << " writer threads:" << std::endl;
+    std::cout << std::setw(9) << "engine"
+              << std::setw(9) << "changers"
+              << std::setw(16) << "joins+leaves/s"
+              << std::setw(12) << "writes/s"
+              << std::setw(10) << "fenced"
+              << std::setw(13) << "lost writes"
+              << std::setw(12) << "consistent" << std::endl;
+
+    KeyStoreKind saved_kind = KEY_STORE_KIND;
+    KEY_STORE_KIND = STORE_CONCURRENT;
+    for (RoutingEngine* engine : {static_cast<RoutingEngine*>(&CHORD_ENGINE),
+                                  static_cast<RoutingEngine*>(&KADEMLIA_ENGINE)}) {
+        set_routing_engine(engine);
+        for (int changers : {1, 2, 4}) {
+            std::mt19937 rng(42);
+            std::vector<Node*> stable = build_random_ring(stable_count, rng);
+            std::vector<std::vector<int>> free_ids(changers);
+            {
+                std::vector<bool> used(MAX_ID, false);
+                for (Node* node : stable) {
+                    used[node->id] = true;
+                }
+                for (int id = 0; id < MAX_ID; id++) {
+                    if (!used[id]) {
+                        free_ids[id % changers].push_back(id);
+                    }
+                }
+            }
+            FENCED_WRITES = 0;
+
+            std::atomic<bool> stop(false);
+            std::atomic<long> changes(0);
+            std::atomic<long> writes(0);
+            std::vector<std::vector<int>> last_written(writers, std::vector<int>(MAX_ID, -1));
+            std::vector<std::thread> threads;
+            for (int w = 0; w < writers; w++) {
+                threads.emplace_back([&, w]() {
+                    std::mt19937 local(w + 1);
+                    long done = 0;
+                    for (int version = 0; !stop.load(std::memory_order_relaxed); version++) {
+                        int key = static_cast<int>(local() % (MAX_ID / writers)) * writers + w;
+                        stable[local() % stable.size()]->insert_key(key, version);
+                        last_written[w][key] = version;
+                        done++;
+                    }
+                    writes += done;
+                });
+            }
+            for (int c = 0; c < changers; c++) {
+                threads.emplace_back([&, c]() {
+                    std::mt19937 local(100 + c);
+                    std::vector<int>& ids = free_ids[c];
+                    std::vector<Node*> joined;
+                    long done = 0;
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        if (!joined.empty() && (ids.empty() || local() % 2 == 0)) {
+                            size_t victim = local() % joined.size();
+                            Node* node = joined[victim];
+                            joined.erase(joined.begin() + victim);
+                            ids.push_back(node->id);
+                            node->leave();
+                        } else {
+                            size_t pick = local() % ids.size();
+                            Node* node = new Node(ids[pick]);
+                            ids.erase(ids.begin() + pick);
+                            node->join(stable[0]);
+                            joined.push_back(node);
+                        }
+                        done++;
+                    }
+                    changes += done;
+                });
+            }
+
+            auto begin = std::chrono::steady_clock::now();
+            std::this_thread::sleep_for(std::chrono::milliseconds(400));
+            stop = true;
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - begin).count();
+
+            int lost = 0;
+            for (int key = 0; key < MAX_ID; key++) {
+                int expected = last_written[key % writers][key];
+                int value = -1;
+                ROUTING_ENGINE->owner_of(key)->keys->get(key, value);
+                if (value != expected) {
+                    lost++;
+                }
+            }
+            std::cout << std::setw(9) << (engine == &CHORD_ENGINE ? "chord" : "kademlia")
+                      << std::setw(9) << changers << std::fixed << std::setprecision(0)
+                      << std::setw(16) << changes / seconds
+                      << std::setw(12) << writes / seconds
+                      << std::setw(10) << FENCED_WRITES.load()
+                      << std::setw(13) << lost
+                      << std::setw(12) << (check_ring().consistent() ? "yes" : "NO") << std::endl;
+            destroy_ring();
+        }
+    }
+    set_routing_engine(&CHORD_ENGINE);
+    KEY_STORE_KIND = saved_kind;
+    std::cout << std::endl;
+}
+
+void benchmark_write_coalescing() {
+    const int node_count = 32;
+    std::string wal_path = TIER_DIRECTORY + "/dht-wal-XXXXXX";
+    int wal_fd = mkstemp(&wal_path[0]);
+    if (wal_fd < 0) {
+        std::cout << "Cannot create a write-ahead log in " << TIER_DIRECTORY << std::endl << std::endl;
+        return;
+    }
+    close(wal_fd);
+    std::cout << "Writes to one hot owner, " << node_count
+              << " nodes, fdatasync write-ahead log:" << std::endl;
+    std::cout << std::setw(8) << "threads"
+              << std::setw(16) << "direct ops/s"
+              << std::setw(18) << "coalesced ops/s"
+              << std::setw(12) << "avg batch" << std::endl;
+
+    KeyStoreKind saved_kind = KEY_STORE_KIND;
+    KEY_STORE_KIND = STORE_CONCURRENT;
+    size_t wal_failures = 0;
+    for (int threads : {1, 2, 4, 8}) {
+        double rates[2];
+        double avg_batch = 0;
+        for (int coalesce = 0; coalesce < 2; coalesce++) {
+            std::mt19937 rng(42);
+            std::vector<Node*> nodes = build_random_ring(node_count, rng);
+            Node* hot = nodes[0];
+            for (Node* node : nodes) {
+                int span = (node->id - node->range_start + MAX_ID) % MAX_ID;
+                int hot_span = (hot->id - hot->range_start + MAX_ID) % MAX_ID;
+                if (span > hot_span) {
+                    hot = node;
+                }
+            }
+            int hot_start = hot->range_start;
+            int hot_span = (hot->id - hot_start + MAX_ID) % MAX_ID;
+
+            std::remove(wal_path.c_str());
+            WAL = new WriteAheadLog(wal_path, true);
+            COALESCE_WRITES = coalesce == 1;
+            std::atomic<bool> stop(false);
+            std::atomic<long> writes(0);
+            std::vector<std::thread> workers;
+            auto begin = std::chrono::steady_clock::now();
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    std::mt19937 local(t + 1);
+                    long done = 0;
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        int key = (hot_start + 1 + static_cast<int>(local() % hot_span)) % MAX_ID;
+                        nodes[local() % nodes.size()]->insert_key(key, static_cast<int>(done));
+                        done++;
+                    }
+                    writes += done;
+                });
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+            stop = true;
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - begin).count();
+            rates[coalesce] = writes / seconds;
+            if (coalesce == 1 && WAL->appends > 0) {
+                avg_batch = static_cast<double>(WAL->records_written) / WAL->appends;
+            }
+            COALESCE_WRITES = false;
+            wal_failures += WAL->failures;
+            delete WAL;
+            WAL = nullptr;
+            destroy_ring();
+        }
+        std::cout << std::setw(8) << threads << std::fixed << std::setprecision(0)
+                  << std::setw(16) << rates[0]
+                  << std::setw(18) << rates[1] << std::setprecision(2)
+                  << std::setw(12) << avg_batch << std::endl;
+    }
+    std::remove(wal_path.c_str());
+    std::cout << "failed log appends: " << wal_failures << std::endl;
+    KEY_STORE_KIND = saved_kind;
+    std::cout << std::endl;
+}
+
+struct OverloadStats {
+    double p50_us;
+    double p99_us;
+    double completed_per_s;
+    double shed_fraction;
+    double backed_off_fraction;
+};
+
+// Discrete-event model of one owner draining its inbox in group-committed
+// batches (fixed commit cost plus a per-write cost) under Poisson arrivals.
+// With a bounded inbox, rejected writes back off like wait_before_retry
+// and, as in Node::insert_key, are shed on their `max_rejections`th
+// rejection (0 = retried until admitted). Latency runs from first arrival
+// to acknowledgement, so it includes every backoff.
+OverloadStats simulate_owner_queue(double load, int capacity, int max_rejections, unsigned seed) {
+    const double commit_us = 100;
+    const double per_write_us = 2;
+    const int max_batch = 16;
+    const double duration_us = 2e5;
+    double peak_rate = max_batch / (commit_us + per_write_us * max_batch);
+    std::mt19937 rng(seed);
+    std::exponential_distribution<double> gap(load * peak_rate);
+
+    struct Arrival {
+        double time;
+        double first;
+        int attempt;
+        bool operator>(const Arrival& other) const { return time > other.time; }
+    };
+    std::priority_queue<Arrival, std::vector<Arrival>, std::greater<Arrival>> arrivals;
+    for (double t = gap(rng); t < duration_us; t += gap(rng)) {
+        arrivals.push({t, t, 0});
+    }
+
+    std::deque<double> queue;
+    std::vector<double> in_service;
+    std::vector<double> latencies;
+    double busy_until = -1;
+    double end = duration_us;
+    long offered = 0;
+    long shed = 0;
+    long backed_off = 0;
+    while (!arrivals.empty() || !queue.empty() || busy_until >= 0) {
+        bool completion = busy_until >= 0 &&
+            (arrivals.empty() || busy_until <= arrivals.top().time);
+        double now;
+        if (completion) {
+            now = busy_until;
+            for (double first : in_service) {
+                latencies.push_back(now - first);
+            }
+            in_service.clear();
+            busy_until = -1;
+            end = std::max(end, now);
+        } else {
+            Arrival arrival = arrivals.top();
+            arrivals.pop();
+            now = arrival.time;
+            if (arrival.attempt == 0) {
+                offered++;
+            }
+            if (capacity > 0 && static_cast<int>(queue.size()) >= capacity) {
+                if (arrival.attempt == 0) {
+                    backed_off++;
+                }
+                if (max_rejections > 0 && arrival.attempt + 1 >= max_rejections) {
+                    shed++;
+                } else {
+                    int shift = std::min(arrival.attempt, BACKPRESSURE_MAX_SHIFT);
+                    arrivals.push({now + (BACKPRESSURE_BASE_US << shift),
+                                   arrival.first, arrival.attempt + 1});
+                }
+            } else {
+                queue.push_back(arrival.first);
+            }
+        }
+        if (busy_until < 0 && !queue.empty()) {
+            while (!queue.empty() && static_cast<int>(in_service.size()) < max_batch) {
+                in_service.push_back(queue.front());
+                queue.pop_front();
+            }
+            busy_until = now + commit_us + per_write_us * in_service.size();
+        }
+    }
+
+    OverloadStats stats = {0, 0, 0, 0, 0};
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        stats.p50_us = latencies[latencies.size() / 2];
+        stats.p99_us = latencies[latencies.size() * 99 / 100];
+    }
+    stats.completed_per_s = latencies.size() / (end / 1e6);
+    stats.shed_fraction = offered ? static_cast<double>(shed) / offered : 0;
+    stats.backed_off_fraction = offered ? static_cast<double>(backed_off) / offered : 0;
+    return stats;
+}
+
+void benchmark_admission_control() {
+    const int capacity = 64;
+    const int max_rejections = 6;
+    std::cout << "Owner overload simulation, 200 ms of Poisson writes, inbox capacity "
+              << capacity << " vs unbounded, retry until admitted vs shed on rejection "
+              << max_rejections << ":" << std::endl;
+    std::cout << std::setw(6) << "load"
+              << std::setw(10) << "inbox"
+              << std::setw(8) << "retry"
+              << std::setw(12) << "p50 us"
+              << std::setw(12) << "p99 us"
+              << std::setw(14) << "completed/s"
+              << std::setw(12) << "backed off"
+              << std::setw(8) << "shed" << std::endl;
+    for (double load : {0.5, 0.9, 1.5, 3.0}) {
+        for (int mode = 0; mode < 3; mode++) {
+            OverloadStats stats = simulate_owner_queue(load, mode ? capacity : 0,
+                                                       mode == 2 ? max_rejections : 0, 7);
+            std::cout << std::fixed << std::setprecision(1) << std::setw(6) << load
+                      << std::setw(10) << (mode ? "bounded" : "unbounded")
+                      << std::setw(8) << (mode == 2 ? "shed" : "always")
+                      << std::setprecision(0)
+                      << std::setw(12) << stats.p50_us
+                      << std::setw(12) << stats.p99_us
+                      << std::setw(14) << stats.completed_per_s
+                      << std::setprecision(1)
+                      << std::setw(11) << stats.backed_off_fraction * 100 << "%"
+                      << std::setw(7) << stats.shed_fraction * 100 << "%" << std::endl;
+        }
+    }
+
+    // The same policy on the real write path, against an owner whose inbox
+    // is held full and then drained.
+    std::mt19937 rng(42);
+    std::vector<Node*> nodes = build_random_ring(16, rng);
+    bool saved_coalesce = COALESCE_WRITES;
+    COALESCE_WRITES = true;
+    INBOX_CAPACITY = capacity;
+    WRITE_MAX_REJECTIONS = max_rejections;
+    const int key = 77;
+    Node* owner = nodes[0]->find_key(key).first;
+    long shed_before = SHED_WRITES.load();
+    owner->queue_depth += capacity;
+    auto begin = std::chrono::steady_clock::now();
+    bool refused = !nodes[1]->insert_key(key, 1);
+    double refused_us = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - begin).count();
+    owner->queue_depth -= capacity;
+    bool admitted = nodes[1]->insert_key(key, 2);
+    int value = 0;
+    owner->keys->get(key, value);
+    std::cout << "insert_key against a full inbox: returned false " << (refused ? "yes" : "NO")
+              << " after " << std::setprecision(0) << refused_us << " us, SHED_WRITES +"
+              << SHED_WRITES.load() - shed_before << "; once drained: applied "
+              << (admitted && value == 2 ? "yes" : "NO") << std::endl;
+    WRITE_MAX_REJECTIONS = 0;
+    INBOX_CAPACITY = 0;
+    COALESCE_WRITES = saved_coalesce;
+    destroy_ring();
+    std::cout << std::endl;
+}
+
+// Two readers, one writer and one churner against a 64-node ring; returns
+// lookups per second.
+double run_monitored_workload(int milliseconds) {
+    std::mt19937 rng(42);
+    std::vector<Node*> nodes = build_random_ring(64, rng);
+    std::vector<bool> used(MAX_ID, false);
+    for (Node* node : nodes) {
+        used[node->id] = true;
+    }
+    std::vector<int> free_ids;
+    for (int id = 0; id < MAX_ID; id++) {
+        if (!used[id]) {
+            free_ids.push_back(id);
+        }
+    }
+
+    std::atomic<bool> stop(false);
+    std::atomic<long> lookups(0);
+    std::vector<std::thread> threads;
+    for (int r = 0; r < 2; r++) {
+        threads.emplace_back([&, r]() {
+            std::mt19937 local(r + 1);
+            long done = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                nodes[local() % nodes.size()]->find_key(local() % MAX_ID);
+                done++;
+            }
+            lookups += done;
+        });
+    }
+    threads.emplace_back([&]() {
+        std::mt19937 local(7);
+        while (!stop.load(std::memory_order_relaxed)) {
+            nodes[local() % nodes.size()]->insert_key(local() % MAX_ID, 1);
+        }
+    });
+    threads.emplace_back([&]() {
+        std::mt19937 local(9);
+        while (!stop.load(std::memory_order_relaxed)) {
+            size_t pick = local() % free_ids.size();
+            Node* node = new Node(free_ids[pick]);
+            node->join(nodes[0]);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            node->leave();
+        }
+    });
+
+    auto begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+    stop = true;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - begin).count();
+    destroy_ring();
+    return lookups / seconds;
+}
+
+void benchmark_latency_monitor() {
+    std::cout << "Sliding-window latency monitor, " << LATENCY_SLOTS << " x "
+              << LATENCY_SLOT_MS << " ms window, 64 nodes, 2 readers, "
+              << "1 writer, 1 churner:" << std::endl;
+    double plain_rate = run_monitored_workload(300);
+
+    LATENCY.reset();
+    LATENCY.set_trigger(OP_JOIN, 1);
+    MONITOR_LATENCY = true;
+    double monitored_rate = run_monitored_workload(300);
+    MONITOR_LATENCY = false;
+    LATENCY.set_trigger(OP_JOIN, 0);
+
+    std::cout << std::setw(12) << "operation"
+              << std::setw(10) << "count"
+              << std::setw(10) << "p50 ns"
+              << std::setw(10) << "p99 ns"
+              << std::setw(11) << "p999 ns" << std::endl;
+    for (int op = 0; op < OP_COUNT; op++) {
+        LatencySnapshot snapshot = LATENCY.query(static_cast<LatencyOp>(op));
+        std::cout << std::setw(12) << LATENCY_OP_NAMES[op]
+                  << std::setw(10) << snapshot.count
+                  << std::setw(10) << snapshot.p50_ns
+                  << std::setw(10) << snapshot.p99_ns
+                  << std::setw(11) << snapshot.p999_ns << std::endl;
+    }
+    std::cout << std::fixed << std::setprecision(0)
+              << "lookups/s without monitor " << plain_rate
+              << ", with monitor " << monitored_rate << std::endl;
+    std::cout << "join p99 > 1 ns trigger fired " << LATENCY.trigger_fires.load()
+              << " times (traces on stderr)" << std::endl;
+
+    // A recorder that stalled across a rotation lands on the same slot with
+    // a tick one window older; it must not wipe the newer samples.
+    LATENCY.reset();
+    long now = latency_tick();
+    for (int i = 0; i < 3; i++) {
+        LATENCY.record(OP_FIND, 1000, now);
+    }
+    LATENCY.record(OP_FIND, 1000, now - LATENCY_SLOTS);
+    std::cout << "stale recorder keeps the newer window: "
+              << (LATENCY.query(OP_FIND).count == 3 ? "yes" : "NO") << std::endl;
+    LATENCY.reset();
+    std::cout << std::endl;
+}
+
+int connect_loopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::string http_get(int port, const std::string& path) {
+    int fd = connect_loopback(port);
+    std::string response;
+    if (fd >= 0) {
+        std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        char buffer[4096];
+        ssize_t received;
+        while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, static_cast<size_t>(received));
+        }
+        close(fd);
+    }
+    return response;
+}
+
+void benchmark_metrics_endpoint() {
+    std::cout << "Prometheus endpoint, 64 nodes, 2 lookup threads, scraped every 20 ms:"
+              << std::endl;
+    std::mt19937 rng(42);
+    std::vector<Node*> nodes = build_random_ring(64, rng);
+    for (int key = 0; key < MAX_ID; key += 3) {
+        nodes[key % nodes.size()]->insert_key(key, key);
+    }
+
+    MetricsExporter exporter;
+    if (!exporter.start(0)) {
+        std::cout << "could not bind a loopback port" << std::endl << std::endl;
+        destroy_ring();
+        return;
+    }
+    double rates[2];
+    int scrapes = 0;
+    double scrape_us = 0;
+    std::string last;
+    for (int scraping = 0; scraping < 2; scraping++) {
+        std::atomic<bool> stop(false);
+        std::atomic<long> lookups(0);
+        std::vector<std::thread> readers;
+        for (int r = 0; r < 2; r++) {
+            readers.emplace_back([&, r]() {
+                std::mt19937 local(r + 1);
+                long done = 0;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    nodes[local() % nodes.size()]->find_key(local() % MAX_ID);
+                    done++;
+                }
+                lookups += done;
+            });
+        }
+        auto begin = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(300)) {
+            if (scraping) {
+                auto scrape_begin = std::chrono::steady_clock::now();
+                last = http_get(exporter.port(), "/metrics");
+                scrape_us += std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - scrape_begin).count();
+                scrapes++;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        stop = true;
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin).count();
+        rates[scraping] = lookups / seconds;
+    }
+    std::string missing = http_get(exporter.port(), "/");
+    int idle = connect_loopback(exporter.port());
+    auto stall_begin = std::chrono::steady_clock::now();
+    std::string behind_idle = http_get(exporter.port(), "/metrics");
+    double stall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - stall_begin).count();
+    if (idle >= 0) {
+        close(idle);
+    }
+    // The exporter takes no membership lock, so a change in flight cannot
+    // hold a scrape up.
+    std::string during_change;
+    {
+        std::lock_guard<std::mutex> membership(MEMBERSHIP_MUTEX);
+        during_change = http_get(exporter.port(), "/metrics");
+    }
+    exporter.stop();
+
+    int series = 0;
+    size_t gauge_keys = 0;
+    std::istringstream lines(last.substr(std::min(last.size(), last.find("\r\n\r\n") + 4)));
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        series++;
+        if (line.find('{') == std::string::npos) {
+            std::cout << "  " << line << std::endl;
+        }
+        if (line.compare(0, 14, "dht_node_keys{") == 0) {
+            gauge_keys += std::stoul(line.substr(line.rfind(' ') + 1));
+        }
+    }
+    std::cout << std::fixed << std::setprecision(0)
+              << scrapes << " scrapes, " << series << " series, "
+              << scrape_us / std::max(scrapes, 1) << " us per scrape" << std::endl;
+    std::cout << "lookups/s without scrapes " << rates[0]
+              << ", with scrapes " << rates[1] << std::endl;
+    std::cout << "GET / -> " << missing.substr(0, missing.find("\r\n")) << std::endl;
+    std::cout << "scrape behind an idle connection -> "
+              << behind_idle.substr(0, behind_idle.find("\r\n")) << " after " << stall_ms
+              << " ms (client timeout " << CLIENT_TIMEOUT_MS << " ms)" << std::endl;
+    std::cout << "scrape while the membership lock is held -> "
+              << during_change.substr(0, during_change.find("\r\n"))
+              << ", per-node key gauges sum to " << gauge_keys << " of "
+              << count_stored_keys() << " stored keys" << std::endl;
+    destroy_ring();
+    std::cout << std::endl;
+}
+
+// Live bytes per subsystem once the ring holds every key, allocation rate
+// per subsystem during a mixed lookup/write/churn phase, and what is left
+// after teardown. Instrumentation is allocated once up front, so it is
+// reported as a fixed footprint rather than a column of zeros.
+void benchmark_memory_accounting() {
+    std::vector<RoutingEngine*> engines{&CHORD_ENGINE, &KADEMLIA_ENGINE, &SYMPHONY_ENGINE};
+    std::cout << "Memory by subsystem, live KB with " << MAX_ID
+              << " keys stored / MB/s allocated during 20000 lookups, "
+              << "2000 writes and 64 leave+join cycles:" << std::endl;
+    std::cout << std::left << std::setw(16) << "config" << std::right;
+    for (int tag = 0; tag < MEM_INSTRUMENTATION; tag++) {
+        std::cout << std::setw(16) << MEMORY_TAG_NAMES[tag];
+    }
+    std::cout << std::endl;
+
+    uint64_t leaked = 0;
+    for (RoutingEngine* engine : engines) {
+        for (int n : {64, 192}) {
+            set_routing_engine(engine);
+            MemoryUsage before[MEM_TAG_COUNT];
+            for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+                before[tag] = memory_usage(static_cast<MemoryTag>(tag));
+            }
+
+            std::mt19937 rng(42);
+            std::vector<Node*> nodes = build_random_ring(n, rng);
+            for (int key = 0; key < MAX_ID; key++) {
+                nodes[key % nodes.size()]->insert_key(key, key);
+            }
+            MemoryUsage loaded[MEM_TAG_COUNT];
+            for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+                loaded[tag] = memory_usage(static_cast<MemoryTag>(tag));
+            }
+
+            auto begin = std::chrono::steady_clock::now();
+            for (int i = 0; i < 20000; i++) {
+                nodes[rng() % nodes.size()]->find_key(rng() % MAX_ID);
+            }
+            for (int i = 0; i < 2000; i++) {
+                nodes[rng() % nodes.size()]->insert_key(rng() % MAX_ID, i);
+            }
+            for (int i = 0; i < 64; i++) {
+                size_t victim = 1 + rng() % (nodes.size() - 1);
+                int id = nodes[victim]->id;
+                nodes[victim]->leave();
+                nodes[victim] = new Node(id);
+                nodes[victim]->join(nodes[0]);
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - begin).count();
+
+            std::ostringstream config;
+            config << engine->name() << " n=" << n;
+            std::cout << std::left << std::setw(16) << config.str() << std::right;
+            for (int tag = 0; tag < MEM_INSTRUMENTATION; tag++) {
+                MemoryUsage after = memory_usage(static_cast<MemoryTag>(tag));
+                std::ostringstream cell;
+                cell << std::fixed << std::setprecision(1)
+                     << (loaded[tag].live_bytes - before[tag].live_bytes) / 1024.0 << " / "
+                     << (after.allocated_bytes - loaded[tag].allocated_bytes) / seconds / 1e6;
+                std::cout << std::setw(16) << cell.str();
+            }
+            std::cout << std::endl;
+
+            destroy_ring();
+            for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+                leaked += memory_usage(static_cast<MemoryTag>(tag)).live_bytes -
+                          before[tag].live_bytes;
+            }
+        }
+    }
+    set_routing_engine(&CHORD_ENGINE);
+    std::cout << std::fixed << std::setprecision(1) << "instrumentation: "
+              << memory_usage(MEM_INSTRUMENTATION).live_bytes / 1024.0
+              << " KB fixed (latency monitor and metrics), none per operation" << std::endl;
+    std::cout << "live bytes left after teardown: " << leaked << std::endl;
+    std::cout << std::endl;
+}
+
+void benchmark_ring_checker() {
+    std::vector<RoutingEngine*> engines{&CHORD_ENGINE, &KADEMLIA_ENGINE, &SYMPHONY_ENGINE};
+    const int n = 200;
+    std::cout << "Ring consistency checker, " << n << " nodes, " << MAX_ID
+              << " keys, then one crash without repair:" << std::endl;
+    std::cout << std::left << std::setw(10) << "engine" << std::right
+              << std::setw(9) << "entries"
+              << std::setw(7) << "keys"
+              << std::setw(12) << "consistent"
+              << std::setw(12) << "1 thr us"
+              << std::setw(12) << "4 thr us"
+              << std::setw(14) << "crash: bad"
+              << std::setw(10) << "misplaced" << std::endl;
+    for (RoutingEngine* engine : engines) {
+        set_routing_engine(engine);
+        std::mt19937 rng(42);
+        std::vector<Node*> nodes = build_random_ring(n, rng);
+        for (int key = 0; key < MAX_ID; key++) {
+            nodes[key % nodes.size()]->insert_key(key, key);
+        }
+
+        double us[2];
+        RingCheck check = {0, 0, 0, 0, 0, 0, 0, 0};
+        int thread_counts[2] = {1, 4};
+        for (int i = 0; i < 2; i++) {
+            const int repeats = 20;
+            auto begin = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeats; r++) {
+                check = check_ring(thread_counts[i]);
+            }
+            us[i] = std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - begin).count() / repeats;
+        }
 
-class Node {
-public:
-    explicit Node(int node_id);
-    ~Node();
+        crash_node(nodes[n / 2]);
+        RingCheck crashed = check_ring();
+        std::cout << std::left << std::setw(10) << engine->name() << std::right
+                  << std::setw(9) << check.entries_checked
+                  << std::setw(7) << check.keys_checked
+                  << std::setw(12) << (check.consistent() ? "yes" : "NO")
+                  << std::fixed << std::setprecision(0)
+                  << std::setw(12) << us[0]
+                  << std::setw(12) << us[1]
+                  << std::setw(14) << crashed.bad_fingers + crashed.bad_buckets +
+                                      crashed.bad_successors + crashed.bad_ranges
+                  << std::setw(10) << crashed.misplaced_keys << std::endl;
+        destroy_ring();
+    }
+    set_routing_engine(&CHORD_ENGINE);
+    std::cout << std::endl;
+}
 
-    void update_finger_table();
-    Node* get_successor();
-    Node* closest_preceding_finger(int key);
+void benchmark_shadow_mode() {
+    std::vector<RoutingEngine*> engines{&CHORD_ENGINE, &KADEMLIA_ENGINE, &SYMPHONY_ENGINE};
+    std::vector<ShadowOp> stream = make_shadow_stream(32, 20000, 5);
+    std::cout << "Shadow mode against the reference ring, 32 initial nodes, "
+              << stream.size() << " operations:" << std::endl;
+    std::cout << std::left << std::setw(10) << "engine" << std::setw(8) << "op"
+              << std::right << std::setw(8) << "count"
+              << std::setw(10) << "opt ns"
+              << std::setw(10) << "ref ns"
+              << std::setw(10) << "speedup"
+              << std::setw(10) << "diverged" << std::endl;
+    for (RoutingEngine* engine : engines) {
+        ShadowReport report = run_shadow(engine, stream);
+        for (int kind = 0; kind < SHADOW_OP_COUNT; kind++) {
+            double optimized = report.optimized_ns[kind] / std::max(report.ops[kind], 1L);
+            double reference = report.reference_ns[kind] / std::max(report.ops[kind], 1L);
+            std::cout << std::left << std::setw(10) << (kind == 0 ? engine->name() : "")
+                      << std::setw(8) << SHADOW_OP_NAMES[kind] << std::right
+                      << std::setw(8) << report.ops[kind]
+                      << std::fixed << std::setprecision(0)
+                      << std::setw(10) << optimized
+                      << std::setw(10) << reference << std::setprecision(2)
+                      << std::setw(9) << reference / std::max(optimized, 1.0) << "x"
+                      << std::setw(10) << report.divergences[kind] << std::endl;
+        }
+        std::cout << std::left << std::setw(18) << "" << std::right
+                  << "key distribution matches: "
+                  << (report.distribution_matches ? "yes" : "NO") << std::endl;
+        for (const std::string& sample : report.samples) {
+            std::cout << std::left << std::setw(18) << "" << std::right << sample << std::endl;
+        }
+    }
 
-    std::pair<Node*, std::vector<int>> find_key(int key);
-    void insert_key(int key, int value = -1);
-    void remove_key(int key);
+    PLACEMENT = PLACEMENT_TWO_CHOICES;
+    ShadowReport report = run_shadow(&CHORD_ENGINE, stream);
+    PLACEMENT = PLACEMENT_SUCCESSOR;
+    long total = 0;
+    for (long diverged : report.divergences) {
+        total += diverged;
+    }
+    std::cout << "two-choices placement is flagged: " << total << " divergences, "
+              << "key distribution matches: " << (report.distribution_matches ? "yes" : "NO")
+              << std::endl;
+    std::cout << std::endl;
+}
 
-    void join(Node* contact);
-    void leave();
+constexpr std::array<int, 128> static_bench_ids() {
+    std::array<int, 128> ids{};
+    for (int i = 0; i < 128; i++) {
+        ids[i] = (i * 97 + 13) % MAX_ID;
+    }
+    return ids;
+}
 
-    void print_finger_table();
+static constexpr StaticRing<128> STATIC_BENCH_RING = make_static_ring(static_bench_ids());
 
-    int id;
-    FingerTable* finger;
-    std::map<int,int> keys;
-};
+void benchmark_static_ring() {
+    const int n = 128;
+    std::cout << "Compile-time ring, " << n << " fixed node ids:" << std::endl;
+    std::array<int, n> ids = static_bench_ids();
 
-static std::vector<Node*> DHT_NODES;
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<Node*> joined;
+    for (int id : ids) {
+        Node* node = new Node(id);
+        node->join(joined.empty() ? nullptr : joined[0]);
+        joined.push_back(node);
+    }
+    double join_us = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - begin).count();
 
+    long mismatches = 0;
+    double live_ns = 0;
+    double static_ns = 0;
+    {
+        const int rounds = 20;
+        volatile int sink = 0;
+        auto live_begin = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (int key = 0; key < MAX_ID; key++) {
+                sink = sink + joined[(key + r) % n]->find_key(key).first->id;
+            }
+        }
+        auto static_begin = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (int key = 0; key < MAX_ID; key++) {
+                sink = sink + STATIC_BENCH_RING.lookup(ids[(key + r) % n], key).owner;
+            }
+        }
+        auto static_end = std::chrono::steady_clock::now();
+        live_ns = std::chrono::duration<double, std::nano>(static_begin - live_begin).count() /
+                  (rounds * MAX_ID);
+        static_ns = std::chrono::duration<double, std::nano>(static_end - static_begin).count() /
+                    (rounds * MAX_ID);
+    }
+    for (Node* from : joined) {
+        for (int key = 0; key < MAX_ID; key++) {
+            auto live = from->find_key(key);
+            StaticLookup fixed = STATIC_BENCH_RING.lookup(from->id, key);
+            if (live.first->id != fixed.owner ||
+                static_cast<int>(live.second.size()) - 1 != fixed.hops) {
+                mismatches++;
+            }
+        }
+    }
+    destroy_ring();
 
-bool in_interval(int x, int a, int b, bool inclusive=false);
-void update_all_finger_tables();
-Node* get_successor_for(int key);
-Node* get_next_node(Node* node);
-Node* get_predecessor(Node* node);
+    begin = std::chrono::steady_clock::now();
+    instantiate_static_ring(STATIC_BENCH_RING);
+    double static_us = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - begin).count();
+    bool consistent = check_ring().consistent();
+    destroy_ring();
 
+    std::cout << std::fixed << std::setprecision(0)
+              << "startup: joins " << join_us << " us, precomputed tables "
+              << static_us << " us (ring consistent: " << (consistent ? "yes" : "NO") << ")"
+              << std::endl;
+    std::cout << "lookup: live ring " << live_ns << " ns, static ring " << static_ns << " ns"
+              << std::endl;
+    std::cout << "owner and hop mismatches over all " << n * MAX_ID
+              << " (node, key) pairs: " << mismatches << std::endl;
+    std::cout << std::endl;
+}
 
-class FingerTable {
-public:
-    explicit FingerTable(Node* node) : node(node) {
-        entries.resize(M, nullptr);
+uint64_t blob_checksum(const BlobRef& blob) {
+    uint64_t sum = 0;
+    for (size_t c = 0; c < blob.chunk_count(); c++) {
+        std::pair<const char*, size_t> view = blob.chunk(c);
+        for (size_t i = 0; i < view.second; i++) {
+            sum = sum * 31 + static_cast<unsigned char>(view.first[i]);
+        }
     }
+    return sum;
+}
 
-    void update();
-    void pretty_print();
+void benchmark_blob_storage() {
+    const int key_count = 256;
+    std::cout << "Out-of-line blob values, handing " << key_count
+              << " keys to a new owner:" << std::endl;
+    std::cout << std::setw(12) << "value size"
+              << std::setw(16) << "inline us"
+              << std::setw(16) << "handles us"
+              << std::setw(16) << "inline bytes"
+              << std::setw(16) << "handle bytes" << std::endl;
+    for (size_t value_size : {size_t(256), size_t(4096), size_t(65536)}) {
+        std::vector<char> payload(value_size, 'x');
+        std::map<int, std::vector<char>> inline_source;
+        MapKeyStore handle_source;
+        std::vector<int> handles;
+        for (int key = 0; key < key_count; key++) {
+            inline_source[key] = payload;
+            handles.push_back(BLOBS.put(payload.data(), payload.size()));
+            handle_source.put(key, handles.back());
+        }
 
-    std::vector<Node*> entries;
-    Node* node;
-};
+        auto begin = std::chrono::steady_clock::now();
+        std::map<int, std::vector<char>> inline_target;
+        for (auto& kv : inline_source) {
+            inline_target[kv.first] = kv.second;
+        }
+        inline_source.clear();
+        auto middle = std::chrono::steady_clock::now();
+        MapKeyStore handle_target;
+        for (auto& kv : handle_source.extract_range(-1, MAX_ID)) {
+            handle_target.put(kv.first, kv.second);
+        }
+        auto end = std::chrono::steady_clock::now();
+        for (int handle : handles) {
+            BLOBS.release(handle);
+        }
 
-Node::Node(int node_id)
-    : id(node_id), finger(new FingerTable(this)) {}
+        std::cout << std::setw(12) << value_size << std::fixed << std::setprecision(1)
+                  << std::setw(16) << std::chrono::duration<double, std::micro>(middle - begin).count()
+                  << std::setw(16) << std::chrono::duration<double, std::micro>(end - middle).count()
+                  << std::setw(16) << value_size * key_count
+                  << std::setw(16) << 2 * sizeof(int) * key_count << std::endl;
+    }
 
-Node::~Node() {
-    if (finger) {
-        delete finger;
+    std::mt19937 rng(42);
+    std::vector<Node*> nodes = build_random_ring(32, rng);
+    std::vector<uint64_t> expected(MAX_ID);
+    for (int key = 0; key < MAX_ID; key++) {
+        std::vector<char> payload(BLOB_CHUNK_SIZE + 1000 * key % 7919);
+        for (size_t i = 0; i < payload.size(); i++) {
+            payload[i] = static_cast<char>(key * 7 + i);
+        }
+        nodes[0]->insert_blob(key, payload.data(), payload.size());
+        BlobRef blob;
+        nodes[0]->get_blob(key, blob);
+        expected[key] = blob_checksum(blob);
     }
-}
+    size_t blobs_before = BLOBS.live_blobs();
+    uint64_t moved_keys = METRICS.migrated_keys.load();
+    uint64_t moved_bytes = METRICS.migration_bytes.load();
+    for (int i = 0; i < 32; i++) {
+        size_t victim = 1 + rng() % (nodes.size() - 1);
+        int id = nodes[victim]->id;
+        nodes[victim]->leave();
+        nodes[victim] = new Node(id);
+        nodes[victim]->join(nodes[0]);
+    }
+    int intact = 0;
+    for (int key = 0; key < MAX_ID; key++) {
+        BlobRef blob;
+        if (nodes[rng() % nodes.size()]->get_blob(key, blob) && blob_checksum(blob) == expected[key]) {
+            intact++;
+        }
+    }
+    std::cout << "32 leave+join cycles over " << MAX_ID << " blob keys: "
+              << METRICS.migrated_keys.load() - moved_keys << " keys migrated with "
+              << METRICS.migration_bytes.load() - moved_bytes << " bytes, "
+              << intact << "/" << MAX_ID << " blobs intact, live blobs "
+              << blobs_before << " -> " << BLOBS.live_blobs() << std::endl;
+    for (int key = 0; key < MAX_ID; key++) {
+        nodes[0]->remove_blob(key);
+    }
+    destroy_ring();
+    std::cout << "live blobs after removing every key: " << BLOBS.live_blobs() << std::endl;
 
-void Node::update_finger_table() {
-    finger->update();
+    std::vector<Node*> small = build_random_ring(4, rng);
+    small[0]->insert_blob(1, "old", 3);
+    int stale = -1;
+    small[0]->find_key(1).first->keys->get(1, stale);
+    small[0]->insert_blob(1, "new", 3);
+    small[0]->insert_blob(2, "other", 5);
+    small[0]->insert_key(3, stale);
+    small[0]->remove_blob(3);
+    BlobRef pinned;
+    bool stale_pins = pinned.acquire(stale);
+    BlobRef other;
+    bool other_intact = small[0]->get_blob(2, other) && other.size() == 5;
+    other.reset();
+    size_t live = BLOBS.live_blobs();
+    destroy_ring();
+    std::cout << "stale handle after slot reuse pins a blob: " << (stale_pins ? "YES" : "no")
+              << ", remove_blob on a plain value keeps other blobs: " << (other_intact ? "yes" : "NO")
+              << ", live blobs " << live << " -> " << BLOBS.live_blobs() << " after destroy_ring"
+              << std::endl;
+
+    // Each overwrite must release exactly the blob it replaced, wherever
+    // placement put it and however many writers race on the key.
+    PLACEMENT = PLACEMENT_TWO_CHOICES;
+    std::vector<Node*> placed = build_random_ring(8, rng);
+    for (int round = 0; round < 3; round++) {
+        for (int key = 0; key < 64; key++) {
+            placed[round]->insert_blob(key, "v", 1);
+        }
+    }
+    size_t placed_live = BLOBS.live_blobs();
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++) {
+        writers.emplace_back([&, t]() {
+            for (int i = 0; i < 500; i++) {
+                placed[t]->insert_blob(100, "w", 1);
+            }
+        });
+    }
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+    size_t raced_live = BLOBS.live_blobs() - placed_live;
+    destroy_ring();
+    PLACEMENT = PLACEMENT_SUCCESSOR;
+    std::cout << "two-choices overwrites of 64 keys leave " << placed_live
+              << " blobs live, 4 racing writers of one key leave " << raced_live << std::endl;
+    std::cout << std::endl;
 }
 
-Node* Node::get_successor() {
-    return finger->entries[0];
+void benchmark_small_stores() {
+    const int store_count = 100000;
+    const int lookups = 2000000;
+    SmallKeyStore churned;
+    SmallKeyStore spilled;
+    std::cout << "Per-node key stores for lightly loaded owners, "
+              << store_count << " node records:" << std::endl;
+    std::cout << "small store matches std::map reference across spills: "
+              << (key_store_matches_map(&churned, 13, 2 * SMALL_STORE_CAPACITY) &&
+                  key_store_matches_map(&spilled, 17) ? "yes" : "NO") << std::endl;
+    std::cout << std::setw(12) << "keys/store"
+              << std::setw(18) << "map bytes/node"
+              << std::setw(18) << "small bytes/node"
+              << std::setw(14) << "map get ns"
+              << std::setw(14) << "small get ns" << std::endl;
+    for (int keys_per_store : {1, 4, 8, 16}) {
+        double bytes[2];
+        double get_ns[2];
+        for (int kind = 0; kind < 2; kind++) {
+            // Whole node records, so the small store's inline buffer is
+            // weighed against the map store's separate allocation.
+            std::mt19937 rng(keys_per_store);
+            KEY_STORE_KIND = kind == 0 ? STORE_MAP : STORE_SMALL;
+            uint64_t before = memory_usage(MEM_NODES).live_bytes + memory_usage(MEM_KEYS).live_bytes;
+            std::vector<Node*> nodes;
+            for (int i = 0; i < store_count; i++) {
+                Node* node = new Node(i);
+                for (int k = 0; k < keys_per_store; k++) {
+                    node->keys->put(rng() % MAX_ID, i);
+                }
+                nodes.push_back(node);
+            }
+            bytes[kind] = double(memory_usage(MEM_NODES).live_bytes + memory_usage(MEM_KEYS).live_bytes -
+                                 before) / store_count;
+
+            int value = 0;
+            long found = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (int op = 0; op < lookups; op++) {
+                found += nodes[rng() % store_count]->keys->get(rng() % MAX_ID, value);
+            }
+            auto end = std::chrono::steady_clock::now();
+            get_ns[kind] = std::chrono::duration<double, std::nano>(end - begin).count() / lookups;
+            BENCH_SINK = found + value;
+            for (Node* node : nodes) {
+                delete node;
+            }
+        }
+        KEY_STORE_KIND = STORE_MAP;
+        std::cout << std::setw(12) << keys_per_store << std::fixed << std::setprecision(1)
+                  << std::setw(18) << bytes[0]
+                  << std::setw(18) << bytes[1]
+                  << std::setw(14) << get_ns[0]
+                  << std::setw(14) << get_ns[1] << std::endl;
+    }
+    std::cout << std::endl;
 }
 
-Node* Node::closest_preceding_finger(int key) {
-    for (int i = M - 1; i >= 0; --i) {
-        Node* candidate = finger->entries[i];
-        if (candidate &&
-            candidate != this &&
-            in_interval(candidate->id, this->id, key, false)) {
-            return candidate;
+std::vector<int> distinct_keys(int n, int universe, std::mt19937& rng) {
+    std::vector<int> keys;
+    std::vector<bool> taken(universe);
+    while (static_cast<int>(keys.size()) < n) {
+        int key = rng() % universe;
+        if (!taken[key]) {
+            taken[key] = true;
+            keys.push_back(key);
         }
     }
-    return this;
+    return keys;
 }
 
-std::pair<Node*, std::vector<int>> Node::find_key(int key) {
-    std::vector<int> path;
-    path.push_back(this->id);
+void benchmark_frozen_stores() {
+    const int universe = 1 << 20;
+    const int lookups = 1000000;
+    EliasFanoKeyStore sparse;
+    EliasFanoKeyStore dense;
+    std::cout << "Frozen Elias-Fano stores, keys drawn from " << universe << " ids:" << std::endl;
+    std::cout << "frozen store matches std::map reference: "
+              << (frozen_store_matches_map(&sparse, 19, 1 << 14) &&
+                  frozen_store_matches_map(&dense, 23, 64) ? "yes" : "NO") << std::endl;
+    std::cout << std::setw(8) << "keys"
+              << std::setw(14) << "key bits/key"
+              << std::setw(14) << "minimum"
+              << std::setw(16) << "map bytes/key"
+              << std::setw(18) << "frozen bytes/key"
+              << std::setw(12) << "map get ns"
+              << std::setw(14) << "frozen get ns"
+              << std::setw(16) << "extract half us" << std::endl;
+    for (int n : {1 << 10, 1 << 14, 1 << 18}) {
+        std::mt19937 rng(n);
+        std::vector<int> keys = distinct_keys(n, universe, rng);
 
-    Node* current = this;
-    while (true) {
-        Node* succ = current->get_successor();
-        if (in_interval(key, current->id, succ->id, true)) {
-            path.push_back(succ->id);
-            return {succ, path};
-        } else {
-            Node* next_node = current->closest_preceding_finger(key);
-            if (next_node == current) {
-                current = current->get_successor();
-                path.push_back(current->id);
-                return {current, path};
-            } else {
-                current = next_node;
-                path.push_back(current->id);
+        uint64_t before = memory_usage(MEM_KEYS).live_bytes;
+        MapKeyStore map_store;
+        for (int key : keys) {
+            map_store.put(key, key % 1024);
+        }
+        double map_bytes = double(memory_usage(MEM_KEYS).live_bytes - before) / n;
+        before = memory_usage(MEM_KEYS).live_bytes;
+        EliasFanoKeyStore* frozen = new EliasFanoKeyStore();
+        for (auto& kv : map_store.items()) {
+            frozen->put(kv.first, kv.second);
+        }
+        frozen->freeze();
+        double frozen_bytes = double(memory_usage(MEM_KEYS).live_bytes - before) / n;
+        size_t key_bits = frozen->key_bits();
+        double minimum = (std::lgamma(universe + 1.0) - std::lgamma(n + 1.0) -
+                          std::lgamma(universe - n + 1.0)) / std::log(2.0) / n;
+
+        double get_ns[2];
+        for (int kind = 0; kind < 2; kind++) {
+            KeyStore* store = kind == 0 ? static_cast<KeyStore*>(&map_store) : frozen;
+            std::mt19937 probe(7);
+            int value = 0;
+            long found = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (int op = 0; op < lookups; op++) {
+                int key = op % 2 ? keys[probe() % n] : static_cast<int>(probe() % universe);
+                found += store->get(key, value);
             }
+            auto end = std::chrono::steady_clock::now();
+            get_ns[kind] = std::chrono::duration<double, std::nano>(end - begin).count() / lookups;
+            BENCH_SINK = found + value;
         }
+        auto begin = std::chrono::steady_clock::now();
+        frozen->extract_range(universe / 2, universe);
+        auto end = std::chrono::steady_clock::now();
+
+        std::cout << std::setw(8) << n << std::fixed << std::setprecision(2)
+                  << std::setw(14) << double(key_bits) / n
+                  << std::setw(14) << minimum
+                  << std::setw(16) << map_bytes
+                  << std::setw(18) << frozen_bytes
+                  << std::setprecision(1)
+                  << std::setw(12) << get_ns[0]
+                  << std::setw(14) << get_ns[1]
+                  << std::setw(16) << std::chrono::duration<double, std::micro>(end - begin).count()
+                  << std::endl;
+        delete frozen;
     }
-}
 
-void Node::insert_key(int key, int value) {
-    auto result = find_key(key);
-    Node* responsible = result.first;
-    responsible->keys[key] = value;
+    KeyStoreKind saved_kind = KEY_STORE_KIND;
+    KEY_STORE_KIND = STORE_ELIAS_FANO;
+    std::mt19937 rng(29);
+    std::vector<Node*> nodes = build_random_ring(32, rng);
+    for (int key = 0; key < MAX_ID; key++) {
+        nodes[0]->insert_key(key, key * 3);
+    }
+    int correct = 0;
+    for (Node* node : nodes) {
+        node->freeze_keys();
+    }
+    for (int key = 0; key < MAX_ID; key++) {
+        int value = -1;
+        Node* owner = nodes[rng() % nodes.size()]->find_key(key).first;
+        if (static_cast<EliasFanoKeyStore*>(owner->keys)->frozen() &&
+            owner->keys->get(key, value) && value == key * 3) {
+            correct++;
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        size_t victim = 1 + rng() % (nodes.size() - 1);
+        int id = nodes[victim]->id;
+        nodes[victim]->leave();
+        nodes[victim] = new Node(id);
+        nodes[victim]->join(nodes[0]);
+    }
+    int after_churn = 0;
+    for (int key = 0; key < MAX_ID; key++) {
+        int value = -1;
+        if (nodes[0]->find_key(key).first->keys->get(key, value) && value == key * 3) {
+            after_churn++;
+        }
+    }
+    destroy_ring();
+    KEY_STORE_KIND = saved_kind;
+    std::cout << "32-node ring with frozen stores: " << correct << "/" << MAX_ID
+              << " keys served frozen, " << after_churn << "/" << MAX_ID
+              << " after 8 leave+join cycles" << std::endl;
+    std::cout << std::endl;
 }
 
-void Node::remove_key(int key) {
-    auto result = find_key(key);
-    Node* responsible = result.first;
-    if (responsible->keys.find(key) != responsible->keys.end()) {
-        responsible->keys.erase(key);
+void benchmark_perfect_hash_stores() {
+    const int universe = 1 << 20;
+    const int lookups = 1000000;
+    PerfectHashKeyStore churned;
+    PerfectHashKeyStore frozen_sparse;
+    PerfectHashKeyStore frozen_dense;
+    bool matches = key_store_matches_map(&churned, 31) &&
+                   frozen_store_matches_map(&frozen_sparse, 37, 1 << 14) &&
+                   frozen_store_matches_map(&frozen_dense, 41, 64);
+    std::cout << "Minimal perfect hash stores, keys drawn from " << universe << " ids:" << std::endl;
+    std::cout << "perfect hash store matches std::map reference: " << (matches ? "yes" : "NO")
+              << " (" << churned.rebuilds() << " background rebuilds)" << std::endl;
+    std::cout << std::setw(8) << "keys"
+              << std::setw(16) << "index bits/key"
+              << std::setw(12) << "bytes/key"
+              << std::setw(12) << "build ms"
+              << std::setw(12) << "map get ns"
+              << std::setw(12) << "mph get ns"
+              << std::setw(10) << "put ns"
+              << std::setw(10) << "rebuilds" << std::endl;
+    for (int n : {1 << 10, 1 << 14, 1 << 18}) {
+        std::mt19937 rng(n);
+        std::vector<int> keys = distinct_keys(n, universe, rng);
+        MapKeyStore map_store;
+        for (int key : keys) {
+            map_store.put(key, key % 1024);
+        }
+
+        uint64_t before = memory_usage(MEM_KEYS).live_bytes;
+        PerfectHashKeyStore* store = new PerfectHashKeyStore();
+        for (int key : keys) {
+            store->put(key, key % 1024);
+        }
+        auto begin = std::chrono::steady_clock::now();
+        store->freeze();
+        auto end = std::chrono::steady_clock::now();
+        double build_ms = std::chrono::duration<double, std::milli>(end - begin).count();
+        double bytes = double(memory_usage(MEM_KEYS).live_bytes - before) / n;
+        double bits = double(store->index_bits()) / n;
+
+        double get_ns[2];
+        for (int kind = 0; kind < 2; kind++) {
+            KeyStore* reader = kind == 0 ? static_cast<KeyStore*>(&map_store) : store;
+            std::mt19937 probe(7);
+            int value = 0;
+            long found = 0;
+            begin = std::chrono::steady_clock::now();
+            for (int op = 0; op < lookups; op++) {
+                int key = op % 2 ? keys[probe() % n] : static_cast<int>(probe() % universe);
+                found += reader->get(key, value);
+            }
+            end = std::chrono::steady_clock::now();
+            get_ns[kind] = std::chrono::duration<double, std::nano>(end - begin).count() / lookups;
+            BENCH_SINK = found + value;
+        }
+
+        int writes = n / 4;
+        begin = std::chrono::steady_clock::now();
+        for (int op = 0; op < writes; op++) {
+            store->put(rng() % universe, op);
+        }
+        end = std::chrono::steady_clock::now();
+        double put_ns = std::chrono::duration<double, std::nano>(end - begin).count() / writes;
+        store->wait_for_rebuild();
+
+        std::cout << std::setw(8) << n << std::fixed << std::setprecision(2)
+                  << std::setw(16) << bits
+                  << std::setw(12) << bytes
+                  << std::setprecision(1)
+                  << std::setw(12) << build_ms
+                  << std::setw(12) << get_ns[0]
+                  << std::setw(12) << get_ns[1]
+                  << std::setw(10) << put_ns
+                  << std::setw(10) << store->rebuilds() << std::endl;
+        delete store;
     }
+    std::cout << std::endl;
 }
 
-void Node::join(Node* contact) {
-    if (!contact) {
-        DHT_NODES.push_back(this);
-        update_all_finger_tables();
-    } else {
-        DHT_NODES.push_back(this);
-        update_all_finger_tables();
-        Node* pred = get_predecessor(this);
-        Node* succ = get_next_node(this);
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s.
+class ZipfGenerator {
+public:
+    ZipfGenerator(int n, double s) : cdf(n) {
+        double sum = 0;
+        for (int rank = 0; rank < n; rank++) {
+            sum += std::pow(rank + 1.0, -s);
+            cdf[rank] = sum;
+        }
+        for (double& p : cdf) {
+            p /= sum;
+        }
+    }
 
-        std::vector<int> migrated;
-        std::vector<int> succKeys;
-        for (auto& kv : succ->keys) {
-            succKeys.push_back(kv.first);
+    int operator()(std::mt19937& rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::min<int>(cdf.size() - 1, std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    }
+
+private:
+    std::vector<double> cdf;
+};
+
+void benchmark_cache_mode() {
+    const int universe = 1 << 20;
+    const int requests = 2000000;
+    std::cout << "Cache mode, " << requests << " Zipfian reads over " << universe
+              << " keys, miss fills the key:" << std::endl;
+    std::cout << std::setw(8) << "zipf s"
+              << std::setw(10) << "capacity"
+              << std::setw(10) << "LRU hit%"
+              << std::setw(12) << "LRU Mops/s"
+              << std::setw(16) << "W-TinyLFU hit%"
+              << std::setw(18) << "W-TinyLFU Mops/s" << std::endl;
+    for (double skew : {0.8, 0.99}) {
+        ZipfGenerator zipf(universe, skew);
+        std::mt19937 rng(43);
+        std::vector<int> trace(requests);
+        for (int& key : trace) {
+            key = zipf(rng);
         }
-        for (int k : succKeys) {
-            if (in_interval(k, pred->id, this->id, true)) {
-                this->keys[k] = succ->keys[k];
-                migrated.push_back(k);
-                succ->keys.erase(k);
+        for (size_t capacity : {size_t(1000), size_t(10000)}) {
+            double hit_ratio[2];
+            double rate[2];
+            for (int kind = 0; kind < 2; kind++) {
+                CacheKeyStore cache(capacity, kind == 0 ? 100 : CACHE_WINDOW_PERCENT);
+                long hits = 0;
+                int value = 0;
+                auto begin = std::chrono::steady_clock::now();
+                for (int key : trace) {
+                    if (cache.get(key, value)) {
+                        hits++;
+                    } else {
+                        cache.put(key, key);
+                    }
+                }
+                auto end = std::chrono::steady_clock::now();
+                hit_ratio[kind] = 100.0 * hits / requests;
+                rate[kind] = requests / std::chrono::duration<double, std::micro>(end - begin).count();
             }
+            std::cout << std::fixed << std::setprecision(2) << std::setw(8) << skew
+                      << std::setw(10) << capacity << std::setprecision(1)
+                      << std::setw(10) << hit_ratio[0]
+                      << std::setw(12) << rate[0]
+                      << std::setw(16) << hit_ratio[1]
+                      << std::setw(18) << rate[1] << std::endl;
         }
-        if (!migrated.empty()) {
-            std::sort(migrated.begin(), migrated.end());
-            std::cout << "Migrated keys from node "
-                      << succ->id << " to node " << this->id << ": ";
-            for (size_t i = 0; i < migrated.size(); i++) {
-                std::cout << migrated[i];
-                if (i + 1 < migrated.size()) {
-                    std::cout << " ";
+    }
+
+    KeyStoreKind saved_kind = KEY_STORE_KIND;
+    size_t saved_capacity = CACHE_CAPACITY;
+    KEY_STORE_KIND = STORE_CACHE;
+    CACHE_CAPACITY = 4;
+    std::mt19937 rng(47);
+    std::vector<Node*> nodes = build_random_ring(16, rng);
+    for (int key = 0; key < MAX_ID; key++) {
+        nodes[0]->insert_key(key, key);
+    }
+    size_t largest = 0;
+    size_t cached = 0;
+    uint64_t evictions = 0;
+    for (Node* node : nodes) {
+        largest = std::max(largest, node->keys->size());
+        cached += node->keys->size();
+        evictions += static_cast<CacheKeyStore*>(node->keys)->evictions();
+    }
+    destroy_ring();
+    KEY_STORE_KIND = saved_kind;
+    CACHE_CAPACITY = saved_capacity;
+    std::cout << "16-node ring with 4-entry caches after " << MAX_ID << " inserts: "
+              << cached << " keys cached, largest node " << largest << ", "
+              << evictions << " evictions" << std::endl;
+    std::cout << std::endl;
+}
+
+bool tiered_moves_match_map(unsigned seed) {
+    TieredKeyStore source;
+    TieredKeyStore target;
+    MapKeyStore reference;
+    MapKeyStore reference_target;
+    std::mt19937 rng(seed);
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < 5000; i++) {
+            int key = rng() % 65536;
+            source.put(key, i);
+            reference.put(key, i);
+            if (i % 5 == 0) {
+                key = rng() % 65536;
+                if (source.erase(key) != reference.erase(key)) {
+                    return false;
                 }
             }
-            std::cout << std::endl;
+        }
+        source.wait_for_demotion();
+        int a = rng() % 65536;
+        int b = rng() % 65536;
+        std::vector<int> moved;
+        size_t count = source.move_range(&target, a, b, &moved);
+        KeyList expected = reference.extract_range(a, b);
+        for (auto& kv : expected) {
+            reference_target.put(kv.first, kv.second);
+        }
+        if (count != expected.size() || moved.size() != count ||
+            source.items() != reference.items() || target.items() != reference_target.items() ||
+            source.size() != reference.size() || target.size() != reference_target.size()) {
+            return false;
         }
     }
+    return true;
 }
 
-void Node::leave() {
-    Node* succ = get_next_node(this);
-    for (auto& kv : this->keys) {
-        succ->keys[kv.first] = kv.second;
+// Two threads move the same ranges between two stores in opposite
+// directions; every key must end up in exactly one of them.
+bool tiered_opposite_moves_conserve(int rounds) {
+    TieredKeyStore left;
+    TieredKeyStore right;
+    for (int key = 0; key < 4096; key++) {
+        (key % 2 ? left : right).put(key, key);
     }
-    auto it = std::find(DHT_NODES.begin(), DHT_NODES.end(), this);
-    if (it != DHT_NODES.end()) {
-        DHT_NODES.erase(it);
+    std::vector<std::thread> movers;
+    for (int direction = 0; direction < 2; direction++) {
+        movers.emplace_back([&, direction]() {
+            std::mt19937 rng(71 + direction);
+            for (int round = 0; round < rounds; round++) {
+                int a = rng() % 4096;
+                if (direction == 0) {
+                    left.move_range(&right, a, a + 512);
+                } else {
+                    right.move_range(&left, a, a + 512);
+                }
+            }
+        });
     }
-    update_all_finger_tables();
+    for (std::thread& mover : movers) {
+        mover.join();
+    }
+    KeyList all = left.items();
+    KeyList rest = right.items();
+    all.insert(all.end(), rest.begin(), rest.end());
+    std::sort(all.begin(), all.end());
+    if (all.size() != 4096 || left.size() + right.size() != 4096) {
+        return false;
+    }
+    for (int key = 0; key < 4096; key++) {
+        if (all[key].first != key || all[key].second != key) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void Node::print_finger_table() {
-    finger->pretty_print();
+int process_threads() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0) {
+            return std::stoi(line.substr(8));
+        }
+    }
+    return -1;
 }
 
-void FingerTable::update() {
-    for (int i = 0; i < M; i++) {
-        int start = (node->id + (1 << i)) % MAX_ID;
-        entries[i] = get_successor_for(start);
+void benchmark_tiered_storage() {
+    const int key_count = 1 << 18;
+    const int reads = 1000000;
+    size_t saved_capacity = TIER_HOT_CAPACITY;
+    TIER_HOT_CAPACITY = 64;
+    TieredKeyStore churned;
+    bool matches = key_store_matches_map(&churned, 53) && tiered_moves_match_map(59);
+    std::cout << "Tiered stores, hot keys in memory and cold runs in mmapped files:" << std::endl;
+    std::cout << "tiered store matches std::map reference, including range moves: "
+              << (matches ? "yes" : "NO") << std::endl;
+    int threads_before = process_threads();
+    std::vector<TieredKeyStore*> spilling(64);
+    for (TieredKeyStore*& store : spilling) {
+        store = new TieredKeyStore();
+        for (int key = 0; key < 256; key++) {
+            store->put(key, key);
+        }
     }
-}
+    int demoters = process_threads() - threads_before;
+    for (TieredKeyStore* store : spilling) {
+        store->wait_for_demotion();
+        delete store;
+    }
+    std::cout << "64 spilling stores started " << demoters
+              << " threads of their own, opposite concurrent range moves conserve every key: "
+              << (tiered_opposite_moves_conserve(200) ? "yes" : "NO") << std::endl;
 
-void FingerTable::pretty_print() {
-    std::cout << "Finger table of node " << node->id << ":" << std::endl;
-    for (int i = 0; i < M; i++) {
-        int start = (node->id + (1 << i)) % MAX_ID;
-        std::cout << "start " << start << " -> " << entries[i]->id << std::endl;
+    TIER_HOT_CAPACITY = 1 << 14;
+    std::cout << std::setw(8) << "store"
+              << std::setw(10) << "keys"
+              << std::setw(14) << "bytes/key"
+              << std::setw(12) << "hot keys"
+              << std::setw(12) << "cold runs"
+              << std::setw(16) << "zipf get ns"
+              << std::setw(16) << "move half ms" << std::endl;
+    ZipfGenerator zipf(key_count, 0.99);
+    for (int kind = 0; kind < 2; kind++) {
+        uint64_t before = memory_usage(MEM_KEYS).live_bytes;
+        KeyStore* store = kind == 0 ? static_cast<KeyStore*>(new MapKeyStore()) : new TieredKeyStore();
+        KeyStore* target = kind == 0 ? static_cast<KeyStore*>(new MapKeyStore()) : new TieredKeyStore();
+        TieredKeyStore* tiered = dynamic_cast<TieredKeyStore*>(store);
+        for (int key = 0; key < key_count; key++) {
+            store->put(key, key);
+        }
+        if (tiered) {
+            tiered->wait_for_demotion();
+        }
+        double bytes = double(memory_usage(MEM_KEYS).live_bytes - before) / key_count;
+
+        std::mt19937 rng(61);
+        int value = 0;
+        long found = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (int op = 0; op < reads; op++) {
+            found += store->get(zipf(rng), value);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double get_ns = std::chrono::duration<double, std::nano>(end - begin).count() / reads;
+        BENCH_SINK = found + value;
+        if (tiered) {
+            tiered->wait_for_demotion();
+        }
+        size_t hot_keys = tiered ? tiered->hot_size() : store->size();
+        size_t cold_runs = tiered ? tiered->cold_runs() : 0;
+
+        begin = std::chrono::steady_clock::now();
+        size_t moved = store->move_range(target, -1, key_count / 2 - 1);
+        end = std::chrono::steady_clock::now();
+        std::cout << std::setw(8) << (kind == 0 ? "map" : "tiered")
+                  << std::setw(10) << key_count
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(14) << bytes
+                  << std::setw(12) << hot_keys
+                  << std::setw(12) << cold_runs
+                  << std::setw(16) << get_ns
+                  << std::setw(16) << std::chrono::duration<double, std::milli>(end - begin).count();
+        if (tiered) {
+            std::cout << "  (" << moved << " keys, " << tiered->runs_handed_over()
+                      << " runs handed over)";
+        }
+        std::cout << std::endl;
+        delete store;
+        delete target;
     }
-}
 
-bool in_interval(int x, int a, int b, bool inclusive) {
-    if (a < b) {
-        return inclusive ? (a < x && x <= b) : (a < x && x < b);
-    } else if (a > b) {
-        return inclusive ? (x > a || x <= b) : (x > a || x < b);
-    } else {
-        return true;
+    KeyStoreKind saved_kind = KEY_STORE_KIND;
+    KEY_STORE_KIND = STORE_TIERED;
+    TIER_HOT_CAPACITY = 8;
+    std::mt19937 rng(67);
+    std::vector<Node*> nodes = build_random_ring(8, rng);
+    for (int key = 0; key < MAX_ID; key++) {
+        nodes[0]->insert_key(key, key * 5);
+    }
+    uint64_t leave_runs = 0;
+    for (int i = 0; i < 8; i++) {
+        for (Node* node : nodes) {
+            static_cast<TieredKeyStore*>(node->keys)->wait_for_demotion();
+        }
+        size_t victim = 1 + rng() % (nodes.size() - 1);
+        int id = nodes[victim]->id;
+        {
+            // The guard keeps the retired node's store readable after leave().
+            EpochGuard guard;
+            TieredKeyStore* leaving = static_cast<TieredKeyStore*>(nodes[victim]->keys);
+            uint64_t before = leaving->runs_handed_over();
+            nodes[victim]->leave();
+            leave_runs += leaving->runs_handed_over() - before;
+        }
+        nodes[victim] = new Node(id);
+        nodes[victim]->join(nodes[0]);
+    }
+    int intact = 0;
+    size_t runs = 0;
+    for (int key = 0; key < MAX_ID; key++) {
+        int value = -1;
+        if (nodes[rng() % nodes.size()]->find_key(key).first->keys->get(key, value) && value == key * 5) {
+            intact++;
+        }
+    }
+    for (Node* node : nodes) {
+        runs += static_cast<TieredKeyStore*>(node->keys)->cold_runs();
     }
+    destroy_ring();
+    KEY_STORE_KIND = saved_kind;
+    TIER_HOT_CAPACITY = saved_capacity;
+    std::cout << "8-node ring with 8 hot keys per node, 8 leave+join cycles: "
+              << intact << "/" << MAX_ID << " keys intact, " << runs << " cold runs, "
+              << leave_runs << " runs handed over by leaving nodes" << std::endl;
+    std::cout << std::endl;
 }
 
-void update_all_finger_tables() {
-    for (Node* node : DHT_NODES) {
-        node->update_finger_table();
+void benchmark_routing_modes() {
+    const int n = 128;
+    const int operations = 20000;
+    RoutingMode modes[] = {ROUTE_LOOKUP_THEN_OP, ROUTE_ITERATIVE, ROUTE_RECURSIVE, ROUTE_SEMI_RECURSIVE};
+    const char* mode_names[] = {"lookup+op", "iterative", "recursive", "semi-rec"};
+    std::cout << "Routing modes, " << n << " nodes, " << operations
+              << " operations (50% get / 25% put / 25% remove) from random clients:" << std::endl;
+    std::cout << std::left << std::setw(10) << "engine"
+              << std::setw(12) << "mode" << std::right
+              << std::setw(10) << "avg hops"
+              << std::setw(10) << "msgs/op"
+              << std::setw(10) << "avg ms"
+              << std::setw(10) << "p99 ms" << std::endl;
+    RoutingEngine* saved_engine = ROUTING_ENGINE;
+    RoutingMode saved_mode = ROUTING_MODE;
+    long mismatches = 0;
+    for (RoutingEngine* engine : {static_cast<RoutingEngine*>(&CHORD_ENGINE),
+                                  static_cast<RoutingEngine*>(&KADEMLIA_ENGINE),
+                                  static_cast<RoutingEngine*>(&SYMPHONY_ENGINE)}) {
+        std::mt19937 rng(71);
+        set_routing_engine(engine);
+        std::vector<Node*> nodes = build_random_ring(n, rng);
+        MapKeyStore reference;
+        for (int m = 0; m < 4; m++) {
+            ROUTING_MODE = modes[m];
+            long hops = 0;
+            long messages = 0;
+            std::vector<double> latencies;
+            for (int op = 0; op < operations; op++) {
+                Node* client = nodes[rng() % nodes.size()];
+                int key = rng() % MAX_ID;
+                unsigned action = rng() % 4;
+                RoutedReply reply;
+                if (action < 2) {
+                    reply = client->route_operation(ROUTED_GET, key);
+                    int expected = 0;
+                    bool present = reference.get(key, expected);
+                    if (reply.found != present || (present && reply.value != expected)) {
+                        mismatches++;
+                    }
+                } else if (action == 2) {
+                    reply = client->route_operation(ROUTED_PUT, key, op);
+                    reference.put(key, op);
+                } else {
+                    reply = client->route_operation(ROUTED_REMOVE, key);
+                    reference.erase(key);
+                }
+                hops += reply.hops;
+                messages += reply.messages;
+                latencies.push_back(reply.latency_ms);
+            }
+            std::sort(latencies.begin(), latencies.end());
+            double total = 0;
+            for (double latency : latencies) {
+                total += latency;
+            }
+            std::cout << std::left << std::setw(10) << (m == 0 ? engine->name() : "")
+                      << std::setw(12) << mode_names[m] << std::right
+                      << std::fixed << std::setprecision(2)
+                      << std::setw(10) << double(hops) / operations
+                      << std::setw(10) << double(messages) / operations
+                      << std::setprecision(1)
+                      << std::setw(10) << total / operations
+                      << std::setw(10) << latencies[latencies.size() * 99 / 100] << std::endl;
+        }
+        destroy_ring();
+    }
+    // Redirected and overflowed keys must be found where store_key put them.
+    long placed_mismatches = 0;
+    set_routing_engine(&CHORD_ENGINE);
+    for (PlacementMode placement : {PLACEMENT_BOUNDED_LOAD, PLACEMENT_TWO_CHOICES}) {
+        std::mt19937 rng(73);
+        PLACEMENT = placement;
+        std::vector<Node*> nodes = build_random_ring(32, rng);
+        for (int key = 0; key < MAX_ID; key++) {
+            nodes[rng() % nodes.size()]->route_operation(ROUTED_PUT, key, key * 3);
+        }
+        for (int key = 0; key < MAX_ID; key++) {
+            RoutedReply reply = nodes[rng() % nodes.size()]->route_operation(ROUTED_GET, key);
+            if (!reply.found || reply.value != key * 3) {
+                placed_mismatches++;
+            }
+        }
+        destroy_ring();
     }
+    PLACEMENT = PLACEMENT_SUCCESSOR;
+    set_routing_engine(saved_engine);
+    ROUTING_MODE = saved_mode;
+    std::cout << "gets matching a std::map reference: " << (mismatches == 0 ? "all" : "NOT all")
+              << ", under bounded-load and two-choices placement: "
+              << (placed_mismatches == 0 ? "all" : "NOT all") << std::endl;
+    std::cout << std::endl;
 }
 
-Node* get_successor_for(int key) {
-    std::vector<Node*> sorted_nodes(DHT_NODES.begin(), DHT_NODES.end());
-    std::sort(sorted_nodes.begin(), sorted_nodes.end(),
-              [](Node* a, Node* b){ return a->id < b->id; });
+// Byte `i` of the streamed test value for `key`.
+char stream_byte(int key, size_t i) {
+    return static_cast<char>(key * 7 + i * 13 + (i >> 12));
+}
 
-    for (Node* node : sorted_nodes) {
-        if (node->id >= key) {
-            return node;
+// Uploads `size` bytes for `key`, generated one chunk at a time so the
+// client never holds the whole value either. Returns the status code.
+int http_put_stream(int port, int key, size_t size) {
+    int fd = connect_loopback(port);
+    if (fd < 0) {
+        return 0;
+    }
+    std::string head = "PUT /blob/" + std::to_string(key) + " HTTP/1.1\r\nHost: localhost\r\n"
+                       "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+    bool sent = send_all(fd, head);
+    std::vector<char> chunk(BLOB_CHUNK_SIZE);
+    for (size_t offset = 0; sent && offset < size; offset += chunk.size()) {
+        size_t length = std::min(chunk.size(), size - offset);
+        for (size_t i = 0; i < length; i++) {
+            chunk[i] = stream_byte(key, offset + i);
         }
+        sent = send_all(fd, std::string(chunk.data(), length));
     }
-    return sorted_nodes[0];
+    std::string response;
+    std::string unused;
+    read_request_head(fd, response, unused);
+    close(fd);
+    return response.size() > 12 ? std::atoi(response.c_str() + 9) : 0;
 }
 
-Node* get_next_node(Node* node) {
-    std::vector<Node*> sorted_nodes(DHT_NODES.begin(), DHT_NODES.end());
-    std::sort(sorted_nodes.begin(), sorted_nodes.end(),
-              [](Node* a, Node* b){ return a->id < b->id; });
+// Downloads `key`, folding the body into a blob_checksum()-style sum as
+// it arrives. Returns the number of body bytes received.
+size_t http_get_stream(int port, int key, uint64_t& checksum) {
+    checksum = 0;
+    int fd = connect_loopback(port);
+    if (fd < 0) {
+        return 0;
+    }
+    std::string head;
+    std::string body;
+    size_t received_bytes = 0;
+    if (send_all(fd, "GET /blob/" + std::to_string(key) + " HTTP/1.1\r\nHost: localhost\r\n\r\n") &&
+        read_request_head(fd, head, body) && head.compare(0, 12, "HTTP/1.1 200") == 0) {
+        std::vector<char> chunk(body.begin(), body.end());
+        chunk.resize(std::max(chunk.size(), BLOB_CHUNK_SIZE));
+        ssize_t received = static_cast<ssize_t>(body.size());
+        do {
+            for (ssize_t i = 0; i < received; i++) {
+                checksum = checksum * 31 + static_cast<unsigned char>(chunk[i]);
+            }
+            received_bytes += static_cast<size_t>(received);
+            received = recv(fd, chunk.data(), chunk.size(), 0);
+        } while (received > 0);
+    }
+    close(fd);
+    return received_bytes;
+}
 
-    auto it = std::find(sorted_nodes.begin(), sorted_nodes.end(), node);
-    if (it == sorted_nodes.end()) {
-        return nullptr;
+void benchmark_blob_streaming() {
+    std::cout << "Streaming blob values over loopback HTTP, 16-node ring, "
+              << STREAM_BUFFER_COUNT << " pooled " << BLOB_CHUNK_SIZE / 1024
+              << " KiB buffers:" << std::endl;
+    std::cout << std::setw(12) << "value size"
+              << std::setw(12) << "put MB/s"
+              << std::setw(12) << "get MB/s"
+              << std::setw(10) << "intact"
+              << std::setw(18) << "server buffers"
+              << std::setw(18) << "heap growth" << std::endl;
+    std::mt19937 rng(42);
+    std::vector<Node*> nodes = build_random_ring(16, rng);
+    BlobServer server(nodes[0]);
+    if (!server.start(0)) {
+        std::cout << "cannot listen on loopback" << std::endl << std::endl;
+        destroy_ring();
+        return;
     }
 
-    size_t idx = std::distance(sorted_nodes.begin(), it);
-    return sorted_nodes[(idx + 1) % sorted_nodes.size()];
-}
+    // Allocate the pool up front so heap growth shows only per-request cost.
+    STREAM_BUFFERS.release(STREAM_BUFFERS.acquire());
+    std::vector<int> keys;
+    std::vector<uint64_t> expected;
+    for (size_t value_size : {size_t(64) << 10, size_t(4) << 20, size_t(64) << 20}) {
+        int key = static_cast<int>(keys.size()) * 37 + 5;
+        uint64_t checksum = 0;
+        for (size_t i = 0; i < value_size; i++) {
+            checksum = checksum * 31 + static_cast<unsigned char>(stream_byte(key, i));
+        }
+        STREAM_BUFFERS.reset_peak();
+        uint64_t heap_before = memory_usage(MEM_KEYS).live_bytes;
+        auto begin = std::chrono::steady_clock::now();
+        int status = http_put_stream(server.port(), key, value_size);
+        auto middle = std::chrono::steady_clock::now();
+        uint64_t received_checksum = 0;
+        size_t received = http_get_stream(server.port(), key, received_checksum);
+        auto end = std::chrono::steady_clock::now();
+        uint64_t heap_growth = memory_usage(MEM_KEYS).live_bytes - heap_before;
+        keys.push_back(key);
+        expected.push_back(checksum);
 
-Node* get_predecessor(Node* node) {
-    std::vector<Node*> sorted_nodes(DHT_NODES.begin(), DHT_NODES.end());
-    std::sort(sorted_nodes.begin(), sorted_nodes.end(),
-              [](Node* a, Node* b){ return a->id < b->id; });
+        double megabytes = value_size / 1e6;
+        std::cout << std::setw(12) << value_size << std::fixed << std::setprecision(1)
+                  << std::setw(12) << megabytes / std::chrono::duration<double>(middle - begin).count()
+                  << std::setw(12) << megabytes / std::chrono::duration<double>(end - middle).count()
+                  << std::setw(10) << (status == 201 && received == value_size &&
+                                       received_checksum == checksum ? "yes" : "NO")
+                  << std::setw(18) << STREAM_BUFFERS.peak_in_use() * BLOB_CHUNK_SIZE
+                  << std::setw(18) << heap_growth << std::endl;
+    }
 
-    auto it = std::find(sorted_nodes.begin(), sorted_nodes.end(), node);
-    if (it == sorted_nodes.end()) {
-        return nullptr;
+    for (int i = 0; i < 8; i++) {
+        size_t victim = 1 + rng() % (nodes.size() - 1);
+        int id = nodes[victim]->id;
+        nodes[victim]->leave();
+        nodes[victim] = new Node(id);
+        nodes[victim]->join(nodes[0]);
+    }
+    size_t intact = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+        uint64_t checksum = 0;
+        BlobRef blob;
+        http_get_stream(server.port(), keys[i], checksum);
+        if (checksum == expected[i] && nodes[rng() % nodes.size()]->get_blob(keys[i], blob) &&
+            blob_checksum(blob) == expected[i]) {
+            intact++;
+        }
     }
+    std::cout << "after 8 leave+join cycles: " << intact << "/" << keys.size()
+              << " streamed values intact over HTTP and chunk views" << std::endl;
 
-    size_t idx = std::distance(sorted_nodes.begin(), it);
-    if (idx == 0) {
-        return sorted_nodes[sorted_nodes.size() - 1];
-    } else {
-        return sorted_nodes[idx - 1];
+    auto status_of = [&](const std::string& path) {
+        std::string response = http_get(server.port(), path);
+        return response.size() > 12 ? response.substr(9, 3) : std::string("none");
+    };
+    nodes[0]->insert_key(200, keys[0]);
+    std::cout << "GET /blob/250 (missing) -> " << status_of("/blob/250")
+              << ", /blob/200 (plain value) -> " << status_of("/blob/200")
+              << ", /blob/300 -> " << status_of("/blob/300")
+              << ", /blob/abc -> " << status_of("/blob/abc") << std::endl;
+
+    int stalled = connect_loopback(server.port());
+    send_all(stalled, "PUT /blob/7 HTTP/1.1\r\nContent-Length: 1000000\r\n\r\npartial");
+    auto stall_begin = std::chrono::steady_clock::now();
+    std::string behind = status_of("/blob/" + std::to_string(keys[0]));
+    double stall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - stall_begin).count();
+    close(stalled);
+    std::cout << "GET behind a stalled upload -> " << behind << " after " << std::fixed
+              << std::setprecision(0) << stall_ms << " ms (client timeout " << CLIENT_TIMEOUT_MS
+              << " ms), key 7 stored: "
+              << (nodes[0]->find_key(7).first->keys->contains(7) ? "YES" : "no") << std::endl;
+    server.stop();
+    for (int key : keys) {
+        nodes[0]->remove_blob(key);
     }
+    destroy_ring();
+    std::cout << std::endl;
+}
+
+void run_benchmarks() {
+    LOG_MIGRATIONS = false;
+    benchmark_routing_engines();
+    benchmark_symphony_links();
+    benchmark_bounded_load();
+    benchmark_two_choices();
+    benchmark_concurrent_repair();
+    benchmark_key_stores();
+    benchmark_concurrent_membership();
+    benchmark_write_coalescing();
+    benchmark_admission_control();
+    benchmark_latency_monitor();
+    benchmark_metrics_endpoint();
+    benchmark_memory_accounting();
+    benchmark_ring_checker();
+    benchmark_shadow_mode();
+    benchmark_static_ring();
+    benchmark_blob_storage();
+    benchmark_small_stores();
+    benchmark_frozen_stores();
+    benchmark_perfect_hash_stores();
+    benchmark_cache_mode();
+    benchmark_tiered_storage();
+    benchmark_routing_modes();
+    benchmark_blob_streaming();
 }
 
-int main() {
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        run_benchmarks();
+        return 0;
+    }
+
     DHT_NODES.clear();
 
     Node* n0 = new Node(0);
@@ -301,7 +8328,7 @@ int main() {
                   [](Node* a, Node* b){ return a->id < b->id; });
         for (Node* node : sorted_nodes) {
             std::stringstream ss;
-            for (auto& kv : node->keys) {
+            for (auto& kv : node->keys->items()) {
                 ss << kv.first << ":" << kv.second << " ";
             }
             std::string keys_str = ss.str();
@@ -323,7 +8350,7 @@ int main() {
                   [](Node* a, Node* b){ return a->id < b->id; });
         for (Node* node : sorted_nodes) {
             std::stringstream ss;
-            for (auto& kv : node->keys) {
+            for (auto& kv : node->keys->items()) {
                 ss << kv.first << ":" << kv.second << " ";
             }
             std::string keys_str = ss.str();
@@ -344,13 +8371,10 @@ int main() {
         for (int key : lookup_keys) {
             auto result = start_node->find_key(key);
             Node* responsible_node = result.first;
-            std::vector<int> path = result.second;
+            Path path = result.second;
 
             int value = -1; // default if not found
-            auto it = responsible_node->keys.find(key);
-            if (it != responsible_node->keys.end()) {
-                value = it->second;
-            }
+            responsible_node->keys->get(key, value);
             std::cout << "Look-up result of key " << key
                       << " from node " << start_node->id
                       << " with path [";
@@ -387,7 +8411,7 @@ int main() {
                   [](Node* a, Node* b){ return a->id < b->id; });
         for (Node* node : sorted_nodes) {
             std::stringstream ss;
-            for (auto& kv : node->keys) {
+            for (auto& kv : node->keys->items()) {
                 ss << kv.first << ":" << kv.second << " ";
             }
             std::string keys_str = ss.str();